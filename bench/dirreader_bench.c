@@ -0,0 +1,155 @@
+/* dirreader benchmark Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+/*
+ * Time listing one large directory with the readdir loop dirchanges used to
+ * have and with dirreader at several buffer sizes, best of a few runs each.
+ *
+ *   dirreader_bench [DIRECTORY [COUNT]]
+ *
+ * Without a DIRECTORY, COUNT empty files (300000 by default) are created in
+ * a temporary directory, which is removed afterwards.
+ */
+
+#define _GNU_SOURCE
+
+#include "../dirreader.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_COUNT 300000
+#define RUNS 3
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static size_t listreaddir(const char *path) {
+    size_t count = 0;
+
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != 0)
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            ++count;
+
+    closedir(dir);
+
+    return count;
+}
+
+static size_t listdirreader(const char *path, struct dirreader *reader) {
+    size_t count = 0;
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || dirreader_open(reader, fd) != 1)
+        return 0;
+
+    struct dirreader_entry entry;
+    while (dirreader_next(reader, &entry) == 1)
+        ++count;
+
+    dirreader_close(reader);
+
+    return count;
+}
+
+/* List path RUNS times with readdir, or dirreader if buffersize is not 0, and print the best time. */
+static void bench(const char *path, size_t buffersize) {
+    struct dirreader *reader = buffersize ? dirreader_new(buffersize) : 0;
+    double best = 0;
+    size_t count = 0;
+
+    int run;
+    for (run = 0; run < RUNS; ++run) {
+        double start = now();
+        count = buffersize ? listdirreader(path, reader) : listreaddir(path);
+        double elapsed = now() - start;
+
+        if (run == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    if (buffersize)
+        printf("dirreader, %4zu KiB buffer  %8.1f ms  (%zu entries)\n", buffersize / 1024, best, count);
+    else
+        printf("readdir                     %8.1f ms  (%zu entries)\n", best, count);
+
+    if (reader)
+        dirreader_free(reader);
+}
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = { 32768, 262144, 1048576 };
+    char *path = argc > 1 ? argv[1] : 0;
+    long count = argc > 2 ? atol(argv[2]) : DEFAULT_COUNT;
+    char template[] = "/tmp/dirreader_bench.XXXXXX";
+    char name[64];
+
+    if (!path) {
+        path = mkdtemp(template);
+        if (!path) {
+            perror("mkdtemp");
+            return 1;
+        }
+
+        long x;
+        for (x = 0; x < count; ++x) {
+            snprintf(name, sizeof(name), "%s/file-%08ld", path, x);
+            int fd = open(name, O_WRONLY | O_CREAT, 0644);
+            if (fd < 0) {
+                perror(name);
+                return 1;
+            }
+            close(fd);
+        }
+    }
+
+    /* One untimed pass to bring the directory into the cache. */
+    listreaddir(path);
+
+    bench(path, 0);
+
+    size_t s;
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+        bench(path, sizes[s]);
+
+    if (path == template) {
+        long x;
+        for (x = 0; x < count; ++x) {
+            snprintf(name, sizeof(name), "%s/file-%08ld", path, x);
+            unlink(name);
+        }
+        rmdir(path);
+    }
+
+    return 0;
+}
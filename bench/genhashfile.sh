@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# Write a synthetic DIRHASH2 hashfile: bench/genhashfile.sh [LINES]
+#
+# Prints LINES lines (10000000 by default) after the header: one directory
+# line followed by 19 regular files, over and over, spread across 1000
+# subdirectories per top-level directory. Each file gets its own digest.
+
+LINES=${1:-10000000}
+
+awk -v lines="$LINES" 'BEGIN {
+	print "DIRHASH2";
+	for (i = 0; i < lines; ++i) {
+		dir = sprintf("dir%05d/sub%03d", int(i / 20000), int(i / 20) % 1000);
+		if (i % 20 == 0)
+			printf("D %s\n", dir);
+		else
+			printf("R %08x2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717 %s/file-%08d.dat\n", i, dir, i);
+	}
+}'
@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Hashing benchmark: bench/hashing.sh [DIRCHANGES [BASELINE]]
+#
+# Times dirchanges -H over one large file (SIZE MiB, 1024 by default) with
+# every file read through the 1 MiB read() buffer (--mmap-min=0) and with
+# every file mapped (--mmap-min=1), then over SIZE MiB split into files of
+# 64 KiB, 1 MiB and 16 MiB. If BASELINE names a dirchanges built before
+# --mmap-min existed, its 8 KiB stdio reads are timed too. Each figure is
+# the best of RUNS runs (3 by default) with the files already in the page
+# cache.
+
+BIN=${1:-./dirchanges}
+BASELINE=$2
+SIZE=${SIZE:-1024}
+RUNS=${RUNS:-3}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/dirchanges-bench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# best LABEL COMMAND...: print the fastest of RUNS runs of COMMAND.
+best()
+{
+	label=$1
+	shift
+	fastest=
+
+	run=0
+	while [ $run -lt "$RUNS" ]; do
+		start=$(date +%s%N)
+		"$@" > /dev/null || return 1
+		elapsed=$((($(date +%s%N) - start) / 1000000))
+
+		if [ -z "$fastest" ] || [ $elapsed -lt "$fastest" ]; then
+			fastest=$elapsed
+		fi
+		run=$((run + 1))
+	done
+
+	printf '  %-28s %6d ms\n' "$label" "$fastest"
+}
+
+# bench DIR: time every way of reading the files in DIR.
+bench()
+{
+	# One untimed pass to bring the files into the page cache.
+	cat "$1"/* > /dev/null
+
+	if [ -n "$BASELINE" ]; then
+		best "8 KiB stdio reads (baseline)" "$BASELINE" -H "$1"
+	fi
+	best "1 MiB read()" "$BIN" --mmap-min=0 -H "$1"
+	best "mmap" "$BIN" --mmap-min=1 -H "$1"
+}
+
+# fill DIR FILESIZE: create SIZE MiB of random data in DIR as files of FILESIZE KiB.
+fill()
+{
+	mkdir "$1" || exit 1
+	count=$((SIZE * 1024 / $2))
+	x=0
+	while [ $x -lt $count ]; do
+		head -c $(($2 * 1024)) /dev/urandom > "$1/f$x" || exit 1
+		x=$((x + 1))
+	done
+}
+
+fill "$WORK/one" $((SIZE * 1024))
+echo "One $SIZE MiB file:"
+bench "$WORK/one"
+rm -rf "$WORK/one"
+
+for filesize in 64 1024 16384; do
+	fill "$WORK/many" $filesize
+	echo "$SIZE MiB in $filesize KiB files:"
+	bench "$WORK/many"
+	rm -rf "$WORK/many"
+done
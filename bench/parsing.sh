@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Hashfile parsing benchmark: bench/parsing.sh [DIRCHANGES [BASELINE]]
+#
+# Generates a LINES-line DIRHASH2 file (10000000 by default) with
+# bench/genhashfile.sh and times loading it with -w naming a directory the
+# file does not contain, so that nothing but parsing is timed; with JOBS
+# set (4 by default) this is repeated with -j JOBS. The file is then compared
+# with itself, which loads every entry twice, and -H is timed on its first
+# 1000000 lines, which includes printing them. If BASELINE names an
+# older build it is timed the same way. Each figure is the best of RUNS
+# runs (3 by default) with the file in the page cache.
+
+BIN=${1:-./dirchanges}
+BASELINE=$2
+LINES=${LINES:-10000000}
+JOBS=${JOBS:-4}
+RUNS=${RUNS:-3}
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/dirchanges-bench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# best LABEL COMMAND...: print the fastest of RUNS runs of COMMAND.
+best()
+{
+	label=$1
+	shift
+	fastest=
+
+	run=0
+	while [ $run -lt "$RUNS" ]; do
+		start=$(date +%s%N)
+		"$@" > /dev/null 2>&1
+		elapsed=$((($(date +%s%N) - start) / 1000000))
+
+		if [ -z "$fastest" ] || [ $elapsed -lt "$fastest" ]; then
+			fastest=$elapsed
+		fi
+		run=$((run + 1))
+	done
+
+	printf '  %-28s %8d ms\n' "$label" "$fastest"
+}
+
+# bench LABEL DIRCHANGES: time every run for one build.
+bench()
+{
+	best "$1, parse" "$2" -H "$WORK/big.h2" -w missing
+	if [ "$JOBS" -gt 1 ]; then
+		best "$1, parse -j $JOBS" "$2" -j "$JOBS" -H "$WORK/big.h2" -w missing
+	fi
+	best "$1, compare with itself" "$2" "$WORK/big.h2" "$WORK/big.h2"
+	best "$1, -H 1M lines" "$2" -H "$WORK/1m.h2"
+}
+
+sh "$BENCH/genhashfile.sh" "$LINES" > "$WORK/big.h2" || exit 1
+sh "$BENCH/genhashfile.sh" 1000000 > "$WORK/1m.h2" || exit 1
+
+# One untimed pass to bring the files into the page cache.
+cat "$WORK/big.h2" "$WORK/1m.h2" > /dev/null
+
+echo "$LINES lines, $(wc -c < "$WORK/big.h2") bytes:"
+if [ -n "$BASELINE" ]; then
+	bench baseline "$BASELINE"
+fi
+bench current "$BIN"
@@ -22,7 +22,7 @@
 #define PROGRAM_NAME "dirchanges"
 #define DIRCHANGES_VERSION "1.0.0"
 
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -33,42 +33,137 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <setjmp.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
 #include <libgen.h>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/sysmacros.h>
 
 #include "sha256/sha256.h"
+#include "sha256/sha256mb.h"
 #include "getoptions.h"
+#include "dirreader.h"
+#include "ioring.h"
+#include "hashcache.h"
+#include "patharena.h"
+#include "outbuffer.h"
 
 #define ARCHIVE_BUFFER_SIZE 8192
+#define SMALLFILE_MAX_SIZE 16384
+#define HASHJOB_CHUNK_SIZE 4096
+#define HASHJOB_BATCH_SIZE 64
+#define DIRREADER_BUFFER_SIZE 262144
+#define FILE_BUFFER_SIZE 1048576
+#define MMAP_WINDOW_SIZE 268435456
+#define MMAP_DEFAULT_THRESHOLD 67108864
+#define URING_SLOT_COUNT 256
+#define CACHE_DEFAULT_MAX_SIZE 67108864
+#define MAX_JOB_COUNT 1024
+#define REUSE_RACY_MARGIN_NS 2000000000
+#define HASHFILE_BUFFER_SIZE 1048576
+#define HASHFILE_PARALLEL_MIN_SIZE 8388608
+#define SPILL_BUFFER_SIZE 65536
+#define OUTPUT_BUFFER_SIZE 1048576
+#define PATHARENA_BLOCK_SIZE 65536
+#define SPILL_MAX_RUNS 64
+#define SORT_INSERTION_MAX_SIZE 32
+#define SORT_PARALLEL_MIN_SIZE 262144
+#define STREAM_WINDOW_MIN_SIZE 1024
+#define STREAM_WINDOW_MAX_SIZE 16384
+#define STREAM_PATHARENA_BLOCK_SIZE 4096
+#define ARCHIVE_CHUNK_SIZE 65536
+#define ARCHIVE_CHUNK_COUNT 64
+#define ARCHIVE_PIPELINE_MAX_ENTRIES 1024
 
 #define ISFLAG(a,b) ((a & b) == b)
 #define SETFLAG(a,b) (a |= b)
 #define MAX(X, Y) (X > Y ? X : Y)
 #define MIN(X, Y) (X < Y ? X : Y)
+#define ENTRYNAME(de) ((de)->fullpath + (de)->nameoffset)
 
 #define F_PRINTHASHES  0x0001
 #define F_VERBOSE      0x0002
 #define F_SHORTSUMMARY 0x0004
+#define F_BINARYOUTPUT 0x0008
+#define F_SORTEDOUTPUT 0x0010
+#define F_V3OUTPUT     0x0020
+
+/* Values for options that have no short form. */
+#define OPT_MMAP_MIN 256
+#define OPT_REUSE    257
+#define OPT_CACHE    258
+#define OPT_CACHE_MAX 259
+#define OPT_COMPACT_CACHE 260
+#define OPT_FORMAT   261
+#define OPT_SORTED   262
+#define OPT_MAX_MEMORY 263
+
+#define SNAPSHOT_MAGIC "DIRHASHB"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_SORTED 0x0001
+#define SNAPSHOT_BATCH_SIZE 4096
 
 char *program_name;
 
 unsigned long flags = 0;
 
+int jobcount = 1;
+
+uint64_t mmapthreshold = MMAP_DEFAULT_THRESHOLD;
+
+/* Memory budget for the collections being compared, or 0 for no limit. */
+uint64_t maxmemory = 0;
+
+/* Previous snapshot whose digests may be reused, sorted by full path. */
+struct directoryentrycollection *reusecollection = 0;
+
+/* When the snapshot was written, as the modification time of its file. */
+int64_t reusetime_ns = 0;
+size_t reusedcount = 0;
+size_t cachedcount = 0;
+size_t rehashedcount = 0;
+
+/* Guards the counts above, since FROM and TO may be walked at the same time. */
+pthread_mutex_t countlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Digests of files seen in earlier runs, keyed by device, inode and times. */
+struct hashcache *hashcache = 0;
+uint64_t cachemaxsize = CACHE_DEFAULT_MAX_SIZE;
+
+/* Standard output, for the hashes and differences printed there. */
+struct outbuffer *output = 0;
+
 struct string
 {
 	char *chars;
 	size_t allocated;
 };
 
+/*
+ * The full path lives in the arena of the collection holding the entry (or
+ * in a mapped snapshot), and the name compared between collections is the
+ * part of it starting nameoffset bytes in.
+ */
 struct directoryentry
 {
-	struct string name;
-	struct string fullpath;
+	char *fullpath;
+	uint32_t nameoffset;
 	unsigned char type;
 	unsigned char hash[SHA256_BYTES_SIZE];
+
+	/* File metadata, zero where the source does not record it. */
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	uint64_t inode;
+	uint64_t device;
 };
 
 struct directoryentrycollection
@@ -76,6 +171,78 @@ struct directoryentrycollection
 	size_t length;
 	size_t allocated;
 	struct directoryentry *entries;
+	int sorted;
+	void *map;
+	size_t mapsize;
+	struct patharena *paths;
+	struct entryspill *spill;
+
+	/* Name prefixes of the entries, left by the last sort by name (see entrykey). */
+	uint64_t *prefixes;
+	int sortedbyname;
+
+	/* Nonzero if every entry carries the size, times, inode and device of its file. */
+	int hasmetadata;
+};
+
+/*
+ * Once the entries of a collection take up more than maxbytes, they are
+ * sorted and written out as a run to temporary files, leaving the
+ * collection empty. Runs are merged back together when compared.
+ */
+struct entryspill
+{
+	uint64_t maxbytes;
+	char *root;
+	struct spillrun *runs;
+	size_t runcount;
+};
+
+/*
+ * A spilled run is laid out like a snapshot without its header: snapshot
+ * records in one file and the paths they point to, NUL-terminated and in
+ * the same order, in another, so that any path survives the trip.
+ */
+struct spillrun
+{
+	FILE *records;
+	FILE *paths;
+};
+
+struct spillwriter
+{
+	struct outbuffer *records;
+	struct outbuffer *paths;
+	uint64_t offset;
+};
+
+/*
+ * Binary snapshots hold a header, an array of fixed-size records sorted by
+ * path, and a table of the paths as NUL-terminated strings, all in the byte
+ * order of the machine that wrote them. The checksum is the SHA-256 of
+ * everything after the header.
+ */
+struct snapshotheader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t count;
+	uint64_t stringsize;
+	unsigned char checksum[SHA256_BYTES_SIZE];
+};
+
+struct snapshotrecord
+{
+	uint64_t pathoffset;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	uint64_t inode;
+	uint64_t device;
+	unsigned char hash[SHA256_BYTES_SIZE];
+	unsigned char type;
+	unsigned char reserved[7];
 };
 
 struct BUFFEREDFILE
@@ -94,12 +261,264 @@ struct BUFFEREDFILE
 	uint64_t buffer1end;
 };
 
+/* Reads the entries of a text hashfile one line at a time. */
+struct hashfilereader
+{
+	struct BUFFEREDFILE *bfile;
+	char *path;
+	char *root;
+	int version;
+	int sorted;
+	int verbose;
+	size_t headersize;
+	size_t lineno;
+	int foundone;
+
+	char *buffer;
+	size_t size;
+	size_t start;
+	size_t end;
+};
+
+/*
+ * Sort key for an entry: the first eight bytes of its name (or full path)
+ * packed big-endian, so that comparing prefixes as integers orders names the
+ * way strcmp does, with the rest of the name consulted only on a tie.
+ */
+struct entrykey
+{
+	uint64_t prefix;
+	struct directoryentry *entry;
+};
+
+/*
+ * Walks entries in order, either from a collection in memory or straight
+ * from a sorted hashfile, in which case only the current entry is kept.
+ */
+struct entrycursor
+{
+	struct directoryentrycollection *collection;
+	size_t position;
+	struct hashfilereader *reader;
+	struct spillrun *run;
+	char *root;
+	struct directoryentry entry;
+	struct directoryentry *current;
+	uint64_t key;
+
+	/* A reader's current entry keeps its path in one arena while the next is read into the other. */
+	struct patharena *paths[2];
+
+	/* Where a run's paths are read before they are copied into an arena. */
+	char *pathbuffer;
+	size_t pathallocated;
+
+	/* Cursors merged into this one, and a heap of those with entries left. */
+	struct entrycursor *sources;
+	size_t sourcecount;
+	size_t *heap;
+	size_t heapsize;
+};
+
+struct hashjob
+{
+	char *path;
+	int dirfd;
+	const char *name;
+	struct directoryentrycollection *collection;
+	size_t index;
+	int ok;
+	unsigned char hash[SHA256_BYTES_SIZE];
+};
+
+struct hashjobchunk
+{
+	struct hashjob jobs[HASHJOB_CHUNK_SIZE];
+	size_t count;
+	int window;
+	struct hashjobchunk *next;
+};
+
+struct smallfilejob
+{
+	struct sha256mb_job job;
+	struct hashjob *owner;
+	unsigned char buffer[SMALLFILE_MAX_SIZE];
+};
+
+struct smallfilehasher
+{
+	struct sha256mb mb;
+	struct smallfilejob *jobs;
+	struct smallfilejob *available[SHA256MB_LANES];
+	int availablecount;
+};
+
+struct uringslot
+{
+	struct hashjob *job;
+	int fd;
+	size_t length;
+	int closing;
+	unsigned char buffer[SMALLFILE_MAX_SIZE + 1];
+};
+
+struct uringhasher
+{
+	struct ioring *ring;
+	struct uringslot *slots;
+	struct uringslot *available[URING_SLOT_COUNT];
+	int availablecount;
+	struct smallfilehasher *hasher;
+	unsigned char *buffer;
+};
+
+struct hashqueue
+{
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t drained;
+	struct hashjobchunk *first;
+	struct hashjobchunk *last;
+	struct hashjobchunk *next;
+	size_t nextpos;
+	int closed;
+
+	/* Jobs are queued for one of two alternating windows; workers count down those of each not yet hashed. */
+	int window;
+	size_t pending[2];
+	int draining;
+
+	int rootfd;
+	struct smallfilehasher *hasher;
+	struct uringhasher *uring;
+	unsigned char *buffer;
+	pthread_t *workers;
+	int workercount;
+};
+
+struct walktask
+{
+	struct string path;
+	struct directoryentrycollection *entries;
+	struct walktask **subtasks;
+	size_t subtaskcount;
+	size_t subtaskallocated;
+
+	/* For a walk printed as it goes: the window the directory was listed in, and its own paths. */
+	size_t window;
+	struct patharena *paths;
+};
+
+/* A directory part way through a walk printed as it goes. */
+struct walkframe
+{
+	struct walktask *task;
+	size_t entry;
+	size_t subtask;
+};
+
+struct walkstack
+{
+	struct walkframe *frames;
+	size_t count;
+	size_t allocated;
+};
+
+struct walkdeque
+{
+	pthread_mutex_t lock;
+	struct walktask **tasks;
+	size_t allocated;
+	size_t head;
+	size_t tail;
+};
+
+struct walker
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	size_t pending;
+	size_t pushes;
+	struct walkdeque *deques;
+	int threadcount;
+	int rootfd;
+	char *root;
+	char *verbosepath;
+	struct hashqueue *hashes;
+};
+
+struct walkerthread
+{
+	struct walker *walker;
+	int id;
+	struct dirreader *reader;
+	struct patharena *paths;
+	size_t reused;
+	size_t cached;
+	size_t rehashed;
+	pthread_t thread;
+};
+
 struct libarchivedata
 {
 	struct BUFFEREDFILE *bstream;
 	unsigned char buffer[ARCHIVE_BUFFER_SIZE];
 };
 
+struct archivechunk
+{
+	struct archivechunk *next;
+	size_t length;
+	unsigned char data[ARCHIVE_CHUNK_SIZE];
+};
+
+/* An archive entry, waiting for its data to be hashed before joining the collection. */
+struct archivejob
+{
+	struct directoryentry entry;
+	struct string path;
+	struct archivechunk *first;
+	struct archivechunk *last;
+	int complete;
+	int done;
+};
+
+/*
+ * Entries of an archive being hashed by worker threads while the archive is
+ * still being read. Jobs sit in a ring in archive order: those from head to
+ * claimed are being hashed or waiting to be collected, and those from
+ * claimed to tail are waiting for a worker. The data of each file is handed
+ * over in chunks taken from a fixed pool and returned once hashed.
+ */
+struct archivepipeline
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t space;
+	struct archivejob jobs[ARCHIVE_PIPELINE_MAX_ENTRIES];
+	size_t head;
+	size_t claimed;
+	size_t tail;
+	struct archivechunk *pool;
+	struct archivechunk *chunks;
+	int closed;
+	pthread_t *workers;
+	int workercount;
+};
+
+/*
+ * Where the error of a thread loading FROM or TO goes, so that main can
+ * report errors in the order FROM then TO; 0 on every other thread. Such an
+ * error ends the loading thread, so it is set to 0 while that thread runs a
+ * walk, a sort or a parse whose state and locks other threads share: errors
+ * there end the process at once instead.
+ */
+__thread char **loaderror = 0;
+
+/* Held by the one thread that exits through fatalerror. */
+pthread_mutex_t fatallock = PTHREAD_MUTEX_INITIALIZER;
+
 void fatalerror(char *message, ...)
 {
 
@@ -107,12 +526,34 @@ void fatalerror(char *message, ...)
 
 	va_start(ap, message);
 
+	if (loaderror)
+	{
+		if (vasprintf(loaderror, message, ap) < 0)
+			*loaderror = "out of memory!";
+
+		va_end(ap);
+		pthread_exit(0);
+	}
+
+	/* Another thread failing at the same time waits here until the process is gone. */
+	pthread_mutex_lock(&fatallock);
+
+	/* Whatever was printed before the error still goes out, as it would through stdio. */
+	if (output)
+		outbuffer_flush(output);
+
+	flockfile(stderr);
+
 	fprintf(stderr, "%s: ", program_name);
 
 	vfprintf(stderr, message, ap);
 
 	fprintf(stderr, "\n");
 
+	funlockfile(stderr);
+
+	va_end(ap);
+
 	exit(1);
 }
 
@@ -122,11 +563,40 @@ void warn(char *message, ...)
 
 	va_start(ap, message);
 
+	flockfile(stderr);
+
 	fprintf(stderr, "%s: ", program_name);
 
 	vfprintf(stderr, message, ap);
 
 	fprintf(stderr, "\n");
+
+	funlockfile(stderr);
+
+	va_end(ap);
+}
+
+/*
+ * Stop if writing to standard output has failed. A reader that went away
+ * early, as head does, ends the program without complaint.
+ */
+void output_check()
+{
+	int error = outbuffer_error(output);
+
+	if (error == EPIPE)
+		exit(1);
+	else if (error != 0)
+		fatalerror("error writing to standard output");
+}
+
+void output_finish()
+{
+	outbuffer_flush(output);
+	output_check();
+
+	outbuffer_free(output);
+	output = 0;
 }
 
 struct BUFFEREDFILE *bufferedfile_init(FILE *stream, size_t maxlookahead)
@@ -335,60 +805,6 @@ void string_removetrailingcharacter(struct string *s, char c)
 		s->chars[spos] = '\0';
 }
 
-size_t string_parse_rawhex(struct string *s, uint8_t *buf, size_t maxbytes)
-{
-	size_t length = strlen(s->chars);
-	size_t bytes = length / 2;
-
-	if (bytes == 0 || length % 2 != 0 || maxbytes < bytes)
-		return 0;
-
-	size_t x;
-	for (x = 0; x < bytes; ++x)
-	{
-		char bs[3];
-		bs[0] = s->chars[x * 2];
-		bs[1] = s->chars[x * 2 + 1];
-		bs[2] = '\0';
-
-		unsigned int uib;
-
-		if (sscanf(bs, "%x", &uib) != 1)
-			return 0;
-
-		buf[x] = (uint8_t) uib;
-	}
-
-	return bytes;
-}
-
-struct string string_fetchtoken(struct string *s, size_t *offset, char *delim)
-{
-	struct string token = string_fromchars("");
-
-	size_t length = strlen(s->chars);
-	while (*offset < length && strchr(delim, s->chars[*offset]) != 0)
-		++*offset;
-
-	for (; *offset < length; ++*offset)
-	{
-		if (strchr(delim, s->chars[*offset]) != 0)
-		{
-			while (*offset < length && strchr(delim, s->chars[*offset]) != 0)
-				++*offset;
-			break;
-		}
-
-		char c[2];
-		c[0] = s->chars[*offset];
-		c[1] = '\0';
-
-		string_append(&token, c);
-	}
-
-	return token;
-}
-
 void string_free(struct string s)
 {
 	if (s.chars)
@@ -398,14 +814,6 @@ void string_free(struct string s)
 	s.allocated = 0;
 }
 
-void string_freemany(struct string *s, int count)
-{
-	int x;
-
-	for (x = 0; x < count; ++x)
-		string_free(s[x]);
-}
-
 char *relativepath(const char *path, const char *root)
 {
 	if (root == 0)
@@ -424,12 +832,6 @@ char *relativepath(const char *path, const char *root)
 		return 0;
 }
 
-void directoryentry_destroy(struct directoryentry *directory)
-{
-	string_free(directory->fullpath);
-	string_free(directory->name);
-}
-
 struct directoryentrycollection *directoryentrycollection_new()
 {
 	struct directoryentrycollection *collection = malloc(sizeof(struct directoryentrycollection));
@@ -445,6 +847,17 @@ struct directoryentrycollection *directoryentrycollection_new()
 
 	collection->allocated = 1;
 	collection->length = 0;
+	collection->sorted = 0;
+	collection->map = 0;
+	collection->mapsize = 0;
+	collection->spill = 0;
+	collection->prefixes = 0;
+	collection->sortedbyname = 0;
+	collection->hasmetadata = 0;
+
+	collection->paths = patharena_new(PATHARENA_BLOCK_SIZE);
+	if (!collection->paths)
+		fatalerror("out of memory!");
 
 	return collection;
 }
@@ -471,641 +884,4135 @@ void directoryentrycollection_free(struct directoryentrycollection *collection)
 	if (collection == 0)
 		return;
 
-	size_t e;
-	for (e = 0; e < collection->length; ++e)
-		directoryentry_destroy(&collection->entries[e]);
-
 	free(collection->entries);
+	free(collection->prefixes);
+	patharena_free(collection->paths);
+
+	if (collection->map)
+		munmap(collection->map, collection->mapsize);
+
+	if (collection->spill)
+	{
+		size_t e;
+		for (e = 0; e < collection->spill->runcount; ++e)
+		{
+			fclose(collection->spill->runs[e].records);
+			fclose(collection->spill->runs[e].paths);
+		}
+
+		free(collection->spill->runs);
+		free(collection->spill);
+	}
+
 	free(collection);
 }
 
-int getfiledigest(char *path, unsigned char *digest)
+/* Read as much of fd as fits in buf, stopping early only at end of file. */
+ssize_t readfully(int fd, unsigned char *buf, size_t count)
 {
-	FILE *stream = fopen(path, "rb");
-	if (!stream)
-		return 0;
+	size_t total = 0;
 
-	sha256 sha256_state;
-	sha256_init(&sha256_state);
-
-	struct BUFFEREDFILE *bf = bufferedfile_init(stream, ARCHIVE_BUFFER_SIZE);
-	if (!bf)
+	while (total < count)
 	{
-		fclose(stream);
-		return 0;
-	}
+		ssize_t r = read(fd, buf + total, count - total);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
 
-	uint8_t buf[ARCHIVE_BUFFER_SIZE];
+		if (r == 0)
+			break;
 
-	size_t read = bufferedfile_getbytes_unbuffered(buf, ARCHIVE_BUFFER_SIZE, bf);
-	while (read > 0)
-	{
-		sha256_append(&sha256_state, buf, read);
-		read = bufferedfile_getbytes_unbuffered(buf, ARCHIVE_BUFFER_SIZE, bf);
+		total += r;
 	}
 
-	sha256_finalize_bytes(&sha256_state, digest);
+	return total;
+}
 
-	fclose(stream);
+/* Set while a thread hashes from a mapping, so a SIGBUS can be recovered from. */
+__thread sigjmp_buf *sigbusjump = 0;
 
-	bufferedfile_destroy(bf);
+void sigbushandler(int sig)
+{
+	if (sigbusjump != 0)
+		siglongjmp(*sigbusjump, 1);
 
-	return 1;
+	signal(SIGBUS, SIG_DFL);
+	raise(SIGBUS);
 }
 
-char *mgetcwd()
+/*
+ * Append the bytes of fd from offset up to size to state, hashing straight
+ * from read-only mappings of up to MMAP_WINDOW_SIZE bytes. Returns 1 on
+ * success and 0 if the file shrank while it was being hashed. Returns -1,
+ * with fd positioned at the first byte not hashed, if a mapping fails.
+ */
+int sha256_appendmapped(sha256 *state, int fd, off_t offset, off_t size)
 {
-	char *buf;
-	size_t bufsize = 1024;
-
-	buf = malloc(bufsize);
-	if (!buf)
-		fatalerror("out of memory!");
+	const off_t pagesize = sysconf(_SC_PAGESIZE);
 
-	while (getcwd(buf, bufsize) == 0)
+	while (offset < size)
 	{
-		if (errno == ERANGE)
+		off_t start = offset - offset % pagesize;
+		size_t length = (size_t)MIN(size - start, (off_t)MMAP_WINDOW_SIZE);
+
+		unsigned char *map = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, start);
+		if (map == MAP_FAILED)
 		{
-			bufsize *= 2;
+			lseek(fd, offset, SEEK_SET);
+			return -1;
+		}
 
-			char *newbuf = realloc(buf, bufsize);
-			if (!newbuf)
-			{
-				free(buf);
-				fatalerror("out of memory!");
-			}
+		madvise(map, length, MADV_SEQUENTIAL);
 
-			buf = newbuf;
-		}
-		else
+		/* Touching pages past a concurrent truncation raises SIGBUS. */
+		sigjmp_buf jump;
+		if (sigsetjmp(jump, 1) != 0)
 		{
-			free(buf);
+			sigbusjump = 0;
+			munmap(map, length);
 			return 0;
 		}
+
+		sigbusjump = &jump;
+		sha256_append(state, map + (offset - start), length - (size_t)(offset - start));
+		sigbusjump = 0;
+
+		munmap(map, length);
+
+		offset = start + length;
 	}
 
-	return buf;
+	return 1;
 }
 
-int openarchive(struct archive *a, void *data)
+/*
+ * Append everything from fd's current position to the end of the file to
+ * state. Files with at least mmapthreshold bytes left are hashed from a
+ * mapping; others, and files that cannot be mapped, are read through buffer,
+ * which must hold FILE_BUFFER_SIZE bytes. Returns 0 on read errors.
+ */
+int sha256_appendfile(sha256 *state, int fd, unsigned char *buffer)
 {
-	return ARCHIVE_OK;
-}
+	struct stat st;
+	off_t offset;
 
-ssize_t readarchive(struct archive *a, void *data, const void **buffer)
-{
-	struct libarchivedata *ldata = data;
+	if (mmapthreshold > 0 && (offset = lseek(fd, 0, SEEK_CUR)) >= 0 && fstat(fd, &st) == 0 &&
+		S_ISREG(st.st_mode) && st.st_size - offset >= (off_t)mmapthreshold)
+	{
+		int result = sha256_appendmapped(state, fd, offset, st.st_size);
+		if (result >= 0)
+			return result;
+	}
 
-	size_t read = bufferedfile_getbytes_unbuffered(ldata->buffer, ARCHIVE_BUFFER_SIZE, ldata->bstream);
-	*buffer = ldata->buffer;
+	ssize_t read;
+	while ((read = readfully(fd, buffer, FILE_BUFFER_SIZE)) > 0)
+		sha256_append(state, buffer, read);
 
-	return read;
+	return read == 0;
 }
 
-int closearchive(struct archive *a, void *data)
+int getfiledigest(int dirfd, const char *path, unsigned char *digest, unsigned char *buffer)
 {
-	return ARCHIVE_OK;
+	int fd = openat(dirfd, path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	sha256 sha256_state;
+	sha256_init(&sha256_state);
+
+	int ok = sha256_appendfile(&sha256_state, fd, buffer);
+
+	close(fd);
+
+	if (ok)
+		sha256_finalize_bytes(&sha256_state, digest);
+
+	return ok;
 }
 
-void directoryentry_print(struct directoryentry *de)
+struct smallfilehasher *smallfilehasher_new()
 {
-	switch (de->type)
-	{
-		case DT_DIR:
-			printf("D ");
-			break;
-		case DT_REG:
-			printf("R ");
-			break;
-		default:
-			printf("? ");
-			break;
-	}
+	struct smallfilehasher *h = malloc(sizeof(struct smallfilehasher));
+	if (!h)
+		fatalerror("out of memory!");
 
-	int x;
+	h->jobs = malloc(sizeof(struct smallfilejob) * SHA256MB_LANES);
+	if (!h->jobs)
+		fatalerror("out of memory!");
 
-	if (de->type == DT_REG)
-	{
-		for (x = 0; x < SHA256_BYTES_SIZE; ++x)
-			printf("%02x", de->hash[x]);
+	sha256mb_init(&h->mb);
 
-		printf(" ");
+	int x;
+	for (x = 0; x < SHA256MB_LANES; ++x)
+	{
+		h->jobs[x].job.user = &h->jobs[x];
+		h->available[x] = &h->jobs[x];
 	}
 
-	printf("%s\n", de->fullpath.chars);
+	h->availablecount = SHA256MB_LANES;
+
+	return h;
 }
 
-int directoryentry_equalbydigest(const struct directoryentry *de1, const struct directoryentry *de2)
+void smallfilehasher_complete(struct smallfilehasher *h, struct sha256mb_job *job)
 {
-	int x;
-	for (x = 0; x < SHA256_BYTES_SIZE; ++x)
-		if (de1->hash[x] != de2->hash[x])
-			return 0;
+	struct smallfilejob *sjob = job->user;
 
-	return 1;
+	memcpy(sjob->owner->hash, job->digest, SHA256_BYTES_SIZE);
+	sjob->owner->ok = 1;
+
+	h->available[h->availablecount++] = sjob;
 }
 
-int directoryentry_comparebyfilename(const void *de1, const void *de2)
+/* Queue the size bytes already in sjob's buffer, the whole file for job. */
+void smallfilehasher_submit(struct smallfilehasher *h, struct smallfilejob *sjob, struct hashjob *job, size_t size)
 {
-	const struct directoryentry *c1 = de1;
-	const struct directoryentry *c2 = de2;
+	struct sha256mb_job *done;
 
-	return strcmp(c1->name.chars, c2->name.chars);
+	h->availablecount--;
+
+	sjob->owner = job;
+	sjob->job.data = sjob->buffer;
+	sjob->job.n_bytes = size;
+
+	if ((done = sha256mb_submit(&h->mb, &sjob->job)) != 0)
+		smallfilehasher_complete(h, done);
 }
 
-int directoryentry_getfromstring(struct string *s, struct directoryentry *entry, char *root)
+/* Queue a copy of the size bytes at data, the whole file for job. */
+void smallfilehasher_addbytes(struct smallfilehasher *h, struct hashjob *job, const unsigned char *data, size_t size)
 {
-	size_t offset = 0;
+	if (h->availablecount == 0)
+		smallfilehasher_complete(h, sha256mb_flush(&h->mb));
 
-	struct string type = string_fetchtoken(s, &offset, " ");
-	if (type.chars[0] != '\0')
-	{
-		if (strcmp(type.chars, "R") == 0) /* Regular file. */
-		{
-			entry->type = DT_REG;
+	struct smallfilejob *sjob = h->available[h->availablecount - 1];
+	memcpy(sjob->buffer, data, size);
 
-			string_free(type);
+	smallfilehasher_submit(h, sjob, job, size);
+}
 
-			struct string signature = string_fetchtoken(s, &offset, " ");
-			if (signature.chars[0] != '\0')
-			{
-				if (string_parse_rawhex(&signature, entry->hash, SHA256_BYTES_SIZE) != SHA256_BYTES_SIZE)
-				{
-					string_free(signature);
-					return -1;
-				}
-				else
-				{
-					string_free(signature);
+/*
+ * Hash the file for job. Files of up to SMALLFILE_MAX_SIZE bytes are read
+ * whole and queued in a SIMD lane, their digest arriving later; larger files
+ * are hashed on the spot using buffer. Returns 0 if the file cannot be read.
+ */
+int smallfilehasher_add(struct smallfilehasher *h, struct hashjob *job, unsigned char *buffer)
+{
+	if (h->availablecount == 0)
+		smallfilehasher_complete(h, sha256mb_flush(&h->mb));
 
-					entry->fullpath = string_fetchtoken(s, &offset, "");
+	struct smallfilejob *sjob = h->available[h->availablecount - 1];
 
-					char *rpath = entry->fullpath.chars;
+	int fd = openat(job->dirfd, job->name, O_RDONLY);
+	if (fd < 0)
+		return 0;
 
-					if (root != 0)
-						rpath = relativepath(entry->fullpath.chars, root);
+	/* Read one byte past the limit to tell small files from large ones. */
+	unsigned char extra;
+	ssize_t read = readfully(fd, sjob->buffer, SMALLFILE_MAX_SIZE);
+	if (read == SMALLFILE_MAX_SIZE)
+	{
+		ssize_t more = readfully(fd, &extra, 1);
+		if (more < 0)
+			read = -1;
+		else if (more == 1)
+		{
+			sha256 sha256_state;
+			sha256_init(&sha256_state);
+			sha256_append(&sha256_state, sjob->buffer, SMALLFILE_MAX_SIZE);
+			sha256_append(&sha256_state, &extra, 1);
 
-					if (!rpath)
-					{
-						string_free(entry->fullpath);
-						return 0;
-					}
+			int ok = sha256_appendfile(&sha256_state, fd, buffer);
 
-					entry->name = string_fromchars(rpath);
+			close(fd);
 
-					return 1;
-				}
-			}
-			else
-			{
-				string_free(signature);
-				return -1;
-			}
-		}
-		else if (strcmp(type.chars, "D") == 0) /* Directory. */
-		{
-			string_free(type);
-
-			entry->type = DT_DIR;
-			entry->fullpath = string_fetchtoken(s, &offset, "");
-
-			char *rpath = entry->fullpath.chars;
-
-			if (root != 0)
-				rpath = relativepath(entry->fullpath.chars, root);
-
-			if (!rpath)
-			{
-				string_free(entry->fullpath);
+			if (!ok)
 				return 0;
-			}
 
-			entry->name = string_fromchars(rpath);
+			sha256_finalize_bytes(&sha256_state, job->hash);
+			job->ok = 1;
 
 			return 1;
 		}
-		else /* Unknown type. */
-		{
-			string_free(type);
-			return -1;
-		}
 	}
 
-	string_free(type);
+	close(fd);
 
-	return 0;
+	if (read < 0)
+		return 0;
+
+	smallfilehasher_submit(h, sjob, job, read);
+
+	return 1;
 }
 
-void directoryentrycollection_sort(struct directoryentrycollection *collection)
+/* Wait for all queued files. */
+void smallfilehasher_flush(struct smallfilehasher *h)
 {
-	qsort(collection->entries, collection->length, sizeof(struct directoryentry), directoryentry_comparebyfilename);
+	struct sha256mb_job *done;
+
+	while ((done = sha256mb_flush(&h->mb)) != 0)
+		smallfilehasher_complete(h, done);
 }
 
-void directoryentrycollection_compare(struct directoryentrycollection *c1, struct directoryentrycollection *c2, char *froot, char *troot)
+/* Wait for all queued files and release the hasher. */
+void smallfilehasher_finish(struct smallfilehasher *h)
 {
-	int differencesfound = 0;
+	smallfilehasher_flush(h);
 
-	directoryentrycollection_sort(c1);
-	directoryentrycollection_sort(c2);
+	free(h->jobs);
+	free(h);
+}
 
-	size_t c1pos = 0;
-	size_t c2pos = 0;
+void directoryentry_getcachekey(const struct directoryentry *entry, struct hashcache_key *key)
+{
+	key->device = entry->device;
+	key->inode = entry->inode;
+	key->size = entry->size;
+	key->mtime_ns = entry->mtime_ns;
+	key->ctime_ns = entry->ctime_ns;
+}
 
-	char *added_message = 0;
-	char *removed_message = 0;
-	char *modified_message = 0;
+void hashjob_run(struct hashjob *job, struct smallfilehasher *hasher, unsigned char *buffer)
+{
+	int ok;
 
-	if (!ISFLAG(flags, F_SHORTSUMMARY)) {
-		added_message    = "   Added";
-		removed_message  = " Removed";
-		modified_message = "Modified";
-	} else {
-		added_message = "+";
-		removed_message = "-";
-		modified_message = "~";
-	}
+	if (hasher != 0)
+		ok = smallfilehasher_add(hasher, job, buffer);
+	else
+		ok = job->ok = getfiledigest(job->dirfd, job->name, job->hash, buffer);
 
-	while (c1pos < c1->length && c2pos < c2->length)
-	{
-		int cmp = strcmp(c1->entries[c1pos].name.chars, c2->entries[c2pos].name.chars);
+	if (!ok)
+		warn("error obtaining hash for %s", job->path);
+}
 
-		if (cmp == 0)
-		{
-			if (c1->entries[c1pos].type == DT_REG && c2->entries[c2pos].type == DT_REG)
-			{
-				if (!directoryentry_equalbydigest(&c1->entries[c1pos], &c2->entries[c2pos]))
-				{
-					differencesfound = 1;
-					printf("%s %s\n", modified_message, relativepath(c2->entries[c2pos].fullpath.chars, troot));
-				}
-			}
-			else if (c1->entries[c1pos].type != c2->entries[c2pos].type)
-			{
-				differencesfound = 1;
-				printf("%s %s\n", modified_message, relativepath(c2->entries[c2pos].fullpath.chars, troot));
-			}
+/*
+ * Create an engine that keeps up to URING_SLOT_COUNT files in flight through
+ * io_uring, so opening, reading and closing many small files costs a few
+ * system calls per batch instead of several per file. Small files go to
+ * hasher when there is one; larger ones are finished synchronously using
+ * buffer. Returns 0 if io_uring is not available.
+ */
+struct uringhasher *uringhasher_new(struct smallfilehasher *hasher, unsigned char *buffer)
+{
+	struct ioring *ring = ioring_new(URING_SLOT_COUNT);
+	if (!ring)
+		return 0;
 
-			c1pos++;
-			c2pos++;
-		}
-		else if (cmp < 0)
-		{
-			differencesfound = 1;
-			printf("%s %s\n", removed_message, relativepath(c1->entries[c1pos].fullpath.chars, froot));
-			c1pos++;
-		}
-		else
-		{
-			differencesfound = 1;
-			printf("%s %s\n", added_message, relativepath(c2->entries[c2pos].fullpath.chars, troot));
-			c2pos++;
-		}
-	}
+	struct uringhasher *u = malloc(sizeof(struct uringhasher));
+	if (!u)
+		fatalerror("out of memory!");
 
-	if (c1pos < c1->length || c2pos < c2->length)
-	{
-		differencesfound = 1;
+	u->slots = malloc(sizeof(struct uringslot) * URING_SLOT_COUNT);
+	if (!u->slots)
+		fatalerror("out of memory!");
+
+	int x;
+	for (x = 0; x < URING_SLOT_COUNT; ++x)
+		u->available[x] = &u->slots[x];
 
-		while (c1pos < c1->length)
-			printf("%s %s\n", removed_message, relativepath(c1->entries[c1pos++].fullpath.chars, froot));
+	u->availablecount = URING_SLOT_COUNT;
+	u->ring = ring;
+	u->hasher = hasher;
+	u->buffer = buffer;
 
-		while (c2pos < c2->length)
-			printf("%s %s\n", added_message, relativepath(c2->entries[c2pos++].fullpath.chars, troot));
-	}
+	return u;
+}
 
-	if (!differencesfound)
-		printf("No differences found.\n");
+/* Nonzero while any file is still in flight. */
+int uringhasher_busy(struct uringhasher *u)
+{
+	return u->availablecount < URING_SLOT_COUNT;
 }
 
-void directoryentrycollection_printhashes(struct directoryentrycollection *collection)
+void uringhasher_close(struct uringhasher *u, struct uringslot *slot)
 {
-	printf("DIRHASH2\n");
+	slot->closing = 1;
 
-	size_t e;
-	for (e = 0; e < collection->length; ++e)
-		directoryentry_print(collection->entries + e);
+	if (!ioring_close(u->ring, slot->fd, slot))
+		fatalerror("io_uring submission queue overflow");
 }
 
-struct string path_append(const char *path, const char *name) {
-	struct string s = string_fromchars("");
+/* Hash a file too large for its slot, continuing from where the ring left off. */
+int uringhasher_hashlarge(struct uringhasher *u, struct uringslot *slot)
+{
+	sha256 sha256_state;
+	sha256_init(&sha256_state);
+	sha256_append(&sha256_state, slot->buffer, slot->length);
 
-	if (path != 0 && strcmp(path, ".") != 0)
-	{
-		string_append(&s, path);
-		string_append(&s, "/");
-	}
+	if (lseek(slot->fd, slot->length, SEEK_SET) < 0 || !sha256_appendfile(&sha256_state, slot->fd, u->buffer))
+		return 0;
 
-	string_append(&s, name);
+	sha256_finalize_bytes(&sha256_state, slot->job->hash);
+	slot->job->ok = 1;
 
-	return s;
+	return 1;
 }
 
-int directoryentry_addfromfilesystem(struct directoryentrycollection *collection, char *path, char *root, char *verbosepath)
+/* Hash a file read whole into its slot. */
+void uringhasher_hashsmall(struct uringhasher *u, struct uringslot *slot)
 {
-	DIR *cd;
-
-	if (path != 0)
-		cd = opendir(path);
+	if (u->hasher)
+	{
+		smallfilehasher_addbytes(u->hasher, slot->job, slot->buffer, slot->length);
+	}
 	else
-		cd = opendir(".");
+	{
+		sha256 sha256_state;
+		sha256_init(&sha256_state);
+		sha256_append(&sha256_state, slot->buffer, slot->length);
+		sha256_finalize_bytes(&sha256_state, slot->job->hash);
+		slot->job->ok = 1;
+	}
+}
 
-	if (cd == 0)
+/* Move slot on to its next request now that the last one returned result. */
+void uringhasher_advance(struct uringhasher *u, struct uringslot *slot, int result)
+{
+	if (slot->closing)
 	{
-		warn("could not open %s", path);
-		return 0;
+		u->available[u->availablecount++] = slot;
+		return;
 	}
 
-	int foundone = 0;
+	if (slot->fd < 0)
+	{
+		if (result < 0)
+		{
+			warn("error obtaining hash for %s", slot->job->path);
+			u->available[u->availablecount++] = slot;
+			return;
+		}
 
-	struct dirent *dirinfo;
-	while ((dirinfo = readdir(cd)) != 0)
+		slot->fd = result;
+	}
+	else if (result < 0)
 	{
-		if (strcmp(dirinfo->d_name, ".") == 0 || strcmp(dirinfo->d_name, "..") == 0)
-			continue;
+		warn("error obtaining hash for %s", slot->job->path);
+		uringhasher_close(u, slot);
+		return;
+	}
+	else if (result == 0)
+	{
+		uringhasher_hashsmall(u, slot);
+		uringhasher_close(u, slot);
+		return;
+	}
+	else
+	{
+		slot->length += result;
 
-		if (dirinfo->d_type == DT_UNKNOWN) {
-			struct stat st;
+		/* Reading one byte past the limit tells small files from large ones. */
+		if (slot->length == SMALLFILE_MAX_SIZE + 1)
+		{
+			if (!uringhasher_hashlarge(u, slot))
+				warn("error obtaining hash for %s", slot->job->path);
 
-			struct string fullpath = path_append(path, dirinfo->d_name);
+			uringhasher_close(u, slot);
+			return;
+		}
+	}
 
-			if (stat(fullpath.chars, &st) != 0) {
-				warn("could not read from '%s'", dirinfo->d_name);
-				string_free(fullpath);
-				continue;
-			}
+	if (!ioring_read(u->ring, slot->fd, slot->buffer + slot->length, SMALLFILE_MAX_SIZE + 1 - slot->length, slot->length, slot))
+		fatalerror("io_uring submission queue overflow");
+}
 
-			if (S_ISREG(st.st_mode))
-				dirinfo->d_type = DT_REG;
-			else if (S_ISDIR(st.st_mode))
-				dirinfo->d_type = DT_DIR;
+/* Start every queued request, wait for at least wait completions, and handle them. */
+void uringhasher_wait(struct uringhasher *u, unsigned wait)
+{
+	struct ioring_completion completion;
 
-			string_free(fullpath);
-		}
+	if (ioring_submit(u->ring, wait) < 0)
+		fatalerror("could not submit I/O requests: %s", strerror(errno));
 
-		if (dirinfo->d_type != DT_DIR && dirinfo->d_type != DT_REG)
-			continue;
+	while (ioring_next(u->ring, &completion))
+		uringhasher_advance(u, completion.user, completion.result);
+}
 
-		struct string s = path_append(path, dirinfo->d_name);
+/* Start hashing the file for job once a slot is free. */
+void uringhasher_add(struct uringhasher *u, struct hashjob *job)
+{
+	while (u->availablecount == 0)
+		uringhasher_wait(u, 1);
 
-		char *rpath = s.chars;
-		if (root != 0)
-			rpath = relativepath(s.chars, root);
+	struct uringslot *slot = u->available[--u->availablecount];
+	slot->job = job;
+	slot->fd = -1;
+	slot->length = 0;
+	slot->closing = 0;
 
-		if (dirinfo->d_type == DT_DIR)
-		{
-			if (rpath != 0)
-			{
-				struct string p = path_append(verbosepath, s.chars);
+	if (!ioring_openat(u->ring, job->dirfd, job->name, O_RDONLY, slot))
+		fatalerror("io_uring submission queue overflow");
+}
 
-				if (ISFLAG(flags, F_VERBOSE))
-					fprintf(stderr, "%s\n", p.chars);
+/* Wait for every file in flight and release the engine. */
+void uringhasher_finish(struct uringhasher *u)
+{
+	while (uringhasher_busy(u))
+		uringhasher_wait(u, 1);
 
-				string_free(p);
+	ioring_free(u->ring);
+	free(u->slots);
+	free(u);
+}
 
-				foundone = 1;
+/*
+ * Move past the chunks that have had all their jobs handed out. Only the last
+ * chunk can still grow; call with the lock held.
+ */
+void hashqueue_skiptaken(struct hashqueue *q)
+{
+	while (q->nextpos == q->next->count && q->next->next != 0)
+	{
+		q->next = q->next->next;
+		q->nextpos = 0;
+	}
+}
 
-				struct directoryentry entry;
-				entry.name = string_fromchars(rpath);
-				entry.fullpath = string_fromchars(s.chars);
-				entry.type = dirinfo->d_type;
+/*
+ * Hand out up to HASHJOB_BATCH_SIZE queued jobs, all from the window stored
+ * in *window; call with the lock held.
+ */
+size_t hashqueue_take(struct hashqueue *q, struct hashjob **jobs, int *window)
+{
+	hashqueue_skiptaken(q);
 
-				directoryentrycollection_add(collection, &entry);
-			}
+	size_t count = MIN(q->next->count - q->nextpos, HASHJOB_BATCH_SIZE);
 
-			foundone = directoryentry_addfromfilesystem(collection, s.chars, root, verbosepath) | foundone;
-		}
-		else if (rpath != 0) {
-			struct string p = path_append(verbosepath, s.chars);
+	*jobs = &q->next->jobs[q->nextpos];
+	*window = q->next->window;
+	q->nextpos += count;
 
-			if (ISFLAG(flags, F_VERBOSE))
-				fprintf(stderr, "%s\n", p.chars);
+	return count;
+}
+
+/* Finish hashing every file handed to uring or hasher, either of which may be 0. */
+void hashqueue_settle(struct uringhasher *uring, struct smallfilehasher *hasher)
+{
+	if (uring)
+		while (uringhasher_busy(uring))
+			uringhasher_wait(uring, 1);
 
-			string_free(p);
+	if (hasher)
+		smallfilehasher_flush(hasher);
+}
+
+void *hashqueue_worker(void *arg)
+{
+	struct hashqueue *q = arg;
+	struct smallfilehasher *hasher = 0;
+
+	if (sha256mb_supported())
+		hasher = smallfilehasher_new();
+
+	unsigned char *buffer = malloc(FILE_BUFFER_SIZE);
+	if (!buffer)
+		fatalerror("out of memory!");
+
+	struct uringhasher *uring = uringhasher_new(hasher, buffer);
+
+	/* Jobs taken from one window that have not been counted as hashed yet. */
+	int window = 0;
+	size_t taken = 0;
 
-			foundone = 1;
+	pthread_mutex_lock(&q->lock);
 
-			struct directoryentry entry;
-			entry.name = string_fromchars(rpath);
-			entry.fullpath = string_fromchars(s.chars);
-			entry.type = dirinfo->d_type;
+	while (1)
+	{
+		struct hashjob *jobs;
+		int batchwindow;
+		size_t count = hashqueue_take(q, &jobs, &batchwindow);
+
+		/*
+		 * Digests can arrive well after their jobs are taken, so the jobs of
+		 * a window are only counted as hashed once everything in flight is
+		 * done: before moving on to the next window, or when the queue has
+		 * run dry and a window is being waited for.
+		 */
+		if (taken > 0 && (count > 0 ? batchwindow != window : q->draining))
+		{
+			pthread_mutex_unlock(&q->lock);
+			hashqueue_settle(uring, hasher);
+			pthread_mutex_lock(&q->lock);
+
+			q->pending[window] -= taken;
+			taken = 0;
+
+			if (q->pending[window] == 0)
+				pthread_cond_broadcast(&q->drained);
+		}
+
+		if (count == 0)
+		{
+			if (q->closed)
+				break;
 
-			if (getfiledigest(s.chars, entry.hash))
+			/* Keep files in flight moving while waiting for more. */
+			if (uring && uringhasher_busy(uring))
 			{
-				directoryentrycollection_add(collection, &entry);
+				pthread_mutex_unlock(&q->lock);
+				uringhasher_wait(uring, 1);
+				pthread_mutex_lock(&q->lock);
 			}
 			else
 			{
-				warn("error obtaining hash for %s", s.chars);
+				pthread_cond_wait(&q->ready, &q->lock);
 			}
+
+			continue;
+		}
+
+		pthread_mutex_unlock(&q->lock);
+
+		size_t x;
+		for (x = 0; x < count; ++x)
+		{
+			if (uring)
+				uringhasher_add(uring, &jobs[x]);
+			else
+				hashjob_run(&jobs[x], hasher, buffer);
 		}
 
-		string_free(s);
+		pthread_mutex_lock(&q->lock);
+
+		window = batchwindow;
+		taken += count;
 	}
 
-	closedir(cd);
+	pthread_mutex_unlock(&q->lock);
 
-	return foundone;
+	if (uring)
+		uringhasher_finish(uring);
+
+	if (hasher)
+		smallfilehasher_finish(hasher);
+
+	free(buffer);
+
+	return 0;
 }
 
-struct directoryentrycollection *directoryentrycollection_getfromfilesystem(char *path, char *root)
+struct hashjobchunk *hashjobchunk_new(int window)
 {
-	struct directoryentrycollection *collection = directoryentrycollection_new();
-	if (!collection)
+	struct hashjobchunk *chunk = malloc(sizeof(struct hashjobchunk));
+	if (!chunk)
 		fatalerror("out of memory!");
 
-	char *cwd = mgetcwd();
-	if (cwd == 0)
-		fatalerror("could not determine current working directory!");
+	chunk->count = 0;
+	chunk->window = window;
+	chunk->next = 0;
 
-	if (chdir(path) != 0)
-		fatalerror("could not chdir to %s!", path);
+	return chunk;
+}
 
-	const int foundone = directoryentry_addfromfilesystem(collection, 0, root, path);
-	if (root && !foundone)
-		fatalerror("subdirectory %s not found in %s", root, path);
+/*
+ * Create a queue for hashing the files below the directory open as rootfd.
+ * With workercount worker threads the queued files are hashed in the
+ * background; with none they are hashed as they are queued.
+ */
+struct hashqueue *hashqueue_new(int workercount, int rootfd)
+{
+	struct hashqueue *q = malloc(sizeof(struct hashqueue));
+	if (!q)
+		fatalerror("out of memory!");
 
-	if (chdir(cwd) != 0)
-		fatalerror("could not chdir to %s!", path);
+	q->first = hashjobchunk_new(0);
+	q->last = q->first;
+	q->next = q->first;
+	q->nextpos = 0;
+	q->closed = 0;
+	q->window = 0;
+	q->pending[0] = 0;
+	q->pending[1] = 0;
+	q->draining = 0;
+	q->rootfd = rootfd;
+	q->hasher = 0;
+	q->uring = 0;
+	q->buffer = 0;
+	q->workers = 0;
+	q->workercount = workercount;
+
+	if (workercount == 0)
+	{
+		/* Batch small files into SIMD lanes when the CPU makes that pay off. */
+		if (sha256mb_supported())
+			q->hasher = smallfilehasher_new();
 
-	return collection;
+		q->buffer = malloc(FILE_BUFFER_SIZE);
+		if (!q->buffer)
+			fatalerror("out of memory!");
+
+		q->uring = uringhasher_new(q->hasher, q->buffer);
+
+		return q;
+	}
+
+	pthread_mutex_init(&q->lock, 0);
+	pthread_cond_init(&q->ready, 0);
+	pthread_cond_init(&q->drained, 0);
+
+	q->workers = malloc(sizeof(pthread_t) * workercount);
+	if (!q->workers)
+		fatalerror("out of memory!");
+
+	int x;
+	for (x = 0; x < workercount; ++x)
+		if (pthread_create(&q->workers[x], 0, hashqueue_worker, q) != 0)
+			fatalerror("could not create hashing thread");
+
+	return q;
 }
 
-struct directoryentrycollection *directoryentrycollection_getfromarchive(struct BUFFEREDFILE *bfile, char *path, char *root)
+/*
+ * Queue a hash of the file called name in the directory open as dirfd, for
+ * the entry at index in collection. Files hashed later by a worker or
+ * through io_uring are opened by their full path from the root instead, as
+ * dirfd may be closed by then.
+ */
+void hashqueue_add(struct hashqueue *q, int dirfd, const char *name, struct directoryentrycollection *collection, size_t index)
 {
-	struct directoryentrycollection *collection = directoryentrycollection_new();
+	if (q->workercount > 0)
+		pthread_mutex_lock(&q->lock);
 
-	struct archive *a;
-	struct archive_entry *entry;
+	if (q->last->count == HASHJOB_CHUNK_SIZE)
+	{
+		q->last->next = hashjobchunk_new(q->window);
+		q->last = q->last->next;
+	}
 
-	a = archive_read_new();
-	archive_read_support_filter_all(a);
-	archive_read_support_format_all(a);
+	struct hashjob *job = &q->last->jobs[q->last->count++];
+	job->path = collection->entries[index].fullpath;
+	job->dirfd = dirfd;
+	job->name = name;
+	job->collection = collection;
+	job->index = index;
+	job->ok = 0;
 
-	struct libarchivedata ldata;
-	ldata.bstream = bfile;
+	if (q->workercount > 0)
+	{
+		job->dirfd = q->rootfd;
+		job->name = job->path;
 
-	int foundone = 0;
-	int archiveresult = 0;
+		++q->pending[q->window];
 
-	if (archive_read_open(a, &ldata, openarchive, readarchive, closearchive) != ARCHIVE_OK)
-		fatalerror("error reading archive '%s'", path);
+		pthread_cond_signal(&q->ready);
+		pthread_mutex_unlock(&q->lock);
+	}
+	else if (q->uring)
+	{
+		job->dirfd = q->rootfd;
+		job->name = job->path;
 
-	while ((archiveresult = archive_read_next_header(a, &entry)) == ARCHIVE_OK)
+		uringhasher_add(q->uring, job);
+	}
+	else
 	{
-		mode_t filetype = archive_entry_filetype(entry);
+		hashjob_run(job, q->hasher, q->buffer);
+	}
+}
 
-		if (filetype == AE_IFREG)
-		{
-			struct string s = string_fromchars(archive_entry_pathname(entry));
+/*
+ * Store the digests of the hashed jobs in chunk in their entries. Entries
+ * whose file could not be hashed have their type set to DT_UNKNOWN so they
+ * can be dropped.
+ */
+void hashjobchunk_store(struct hashjobchunk *chunk)
+{
+	size_t x;
+	for (x = 0; x < chunk->count; ++x)
+	{
+		struct hashjob *job = &chunk->jobs[x];
+		struct directoryentry *entry = &job->collection->entries[job->index];
 
-			char *rpath = s.chars;
-			if (root != 0)
-				rpath = relativepath(s.chars, root);
+		if (job->ok)
+		{
+			memcpy(entry->hash, job->hash, SHA256_BYTES_SIZE);
 
-			if (rpath != 0)
+			if (hashcache)
 			{
-				foundone = 1;
+				struct hashcache_key key;
+				directoryentry_getcachekey(entry, &key);
+				hashcache_add(hashcache, &key, entry->hash);
+			}
+		}
+		else
+		{
+			entry->type = DT_UNKNOWN;
+		}
+	}
+}
+
+/*
+ * Queue the files added from now on for the next window. The queue tells
+ * only two windows apart, so the one before the current window must have
+ * been drained.
+ */
+void hashqueue_nextwindow(struct hashqueue *q)
+{
+	if (q->workercount > 0)
+		pthread_mutex_lock(&q->lock);
+
+	q->window = !q->window;
+
+	/* Give the window a chunk of its own, so no batch mixes two windows. */
+	if (q->last->count == 0)
+	{
+		q->last->window = q->window;
+	}
+	else
+	{
+		q->last->next = hashjobchunk_new(q->window);
+		q->last = q->last->next;
+	}
+
+	if (q->workercount > 0)
+		pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Wait for every file queued for the window before the current one, store
+ * their digests as hashqueue_finish does, and drop their jobs. Files of the
+ * current window go on being hashed.
+ */
+void hashqueue_drain(struct hashqueue *q)
+{
+	const int window = !q->window;
+
+	if (q->workercount > 0)
+	{
+		pthread_mutex_lock(&q->lock);
+
+		/* Idle workers still holding digests in flight settle them once woken. */
+		q->draining = 1;
+		pthread_cond_broadcast(&q->ready);
+
+		while (q->pending[window] > 0)
+			pthread_cond_wait(&q->drained, &q->lock);
+
+		q->draining = 0;
+
+		hashqueue_skiptaken(q);
+
+		pthread_mutex_unlock(&q->lock);
+	}
+	else
+	{
+		hashqueue_settle(q->uring, q->hasher);
+	}
+
+	/* The window's chunks come first, and the current window always has the last one. */
+	while (q->first != q->last && q->first->window == window)
+	{
+		struct hashjobchunk *chunk = q->first;
+
+		hashjobchunk_store(chunk);
+
+		q->first = chunk->next;
+		free(chunk);
+	}
+}
+
+/*
+ * Wait for every queued file, store the digests in their entries, and
+ * release the queue. Entries whose file could not be hashed have their type
+ * set to DT_UNKNOWN so they can be dropped.
+ */
+void hashqueue_finish(struct hashqueue *q)
+{
+	if (q->workercount > 0)
+	{
+		pthread_mutex_lock(&q->lock);
+		q->closed = 1;
+		pthread_cond_broadcast(&q->ready);
+		pthread_mutex_unlock(&q->lock);
+
+		int x;
+		for (x = 0; x < q->workercount; ++x)
+			pthread_join(q->workers[x], 0);
+
+		free(q->workers);
+		pthread_cond_destroy(&q->drained);
+		pthread_cond_destroy(&q->ready);
+		pthread_mutex_destroy(&q->lock);
+	}
+
+	if (q->uring)
+		uringhasher_finish(q->uring);
+
+	if (q->hasher)
+		smallfilehasher_finish(q->hasher);
+
+	free(q->buffer);
+
+	while (q->first)
+	{
+		struct hashjobchunk *chunk = q->first;
+
+		hashjobchunk_store(chunk);
+
+		q->first = chunk->next;
+		free(chunk);
+	}
+
+	free(q);
+}
+
+int openarchive(struct archive *a, void *data)
+{
+	return ARCHIVE_OK;
+}
+
+ssize_t readarchive(struct archive *a, void *data, const void **buffer)
+{
+	struct libarchivedata *ldata = data;
+
+	size_t read = bufferedfile_getbytes_unbuffered(ldata->buffer, ARCHIVE_BUFFER_SIZE, ldata->bstream);
+	*buffer = ldata->buffer;
+
+	return read;
+}
+
+int closearchive(struct archive *a, void *data)
+{
+	return ARCHIVE_OK;
+}
+
+/*
+ * Write de as a line of a text hashfile, in DIRHASH3 form if withmetadata is
+ * set and in DIRHASH2 form otherwise.
+ */
+void directoryentry_print(struct directoryentry *de, int withmetadata, struct outbuffer *out)
+{
+	switch (de->type)
+	{
+		case DT_DIR:
+			outbuffer_write(out, "D ", 2);
+			break;
+		case DT_REG:
+			outbuffer_write(out, "R ", 2);
+			break;
+		default:
+			outbuffer_write(out, "? ", 2);
+			break;
+	}
+
+	if (de->type == DT_REG)
+	{
+		outbuffer_puthex(out, de->hash, SHA256_BYTES_SIZE);
+		outbuffer_putc(out, ' ');
+	}
+
+	if (withmetadata)
+	{
+		outbuffer_putu64(out, de->size);
+		outbuffer_putc(out, ' ');
+		outbuffer_puti64(out, de->mtime_ns);
+		outbuffer_putc(out, ' ');
+		outbuffer_puti64(out, de->ctime_ns);
+		outbuffer_putc(out, ' ');
+		outbuffer_putu64(out, de->inode);
+		outbuffer_putc(out, ' ');
+		outbuffer_putu64(out, de->device);
+		outbuffer_putc(out, ' ');
+	}
+
+	outbuffer_puts(out, de->fullpath);
+	outbuffer_putc(out, '\n');
+}
+
+int directoryentry_equalbydigest(const struct directoryentry *de1, const struct directoryentry *de2)
+{
+	int x;
+	for (x = 0; x < SHA256_BYTES_SIZE; ++x)
+		if (de1->hash[x] != de2->hash[x])
+			return 0;
+
+	return 1;
+}
+
+uint64_t stringprefix(const char *s)
+{
+	uint64_t prefix = 0;
+
+	int x;
+	for (x = 0; x < 8 && s[x] != '\0'; ++x)
+		prefix |= (uint64_t)(unsigned char)s[x] << (56 - 8 * x);
+
+	return prefix;
+}
+
+const char *entrykey_string(const struct entrykey *k, int byname)
+{
+	return byname ? ENTRYNAME(k->entry) : k->entry->fullpath;
+}
+
+/* Order two keys whose strings agree on their first depth bytes. */
+int entrykey_compare(const struct entrykey *k1, const struct entrykey *k2, size_t depth, int byname)
+{
+	if (k1->prefix != k2->prefix)
+		return k1->prefix < k2->prefix ? -1 : 1;
+
+	/* Equal prefixes that end in a terminator are equal strings. */
+	if ((k1->prefix & 0xff) == 0)
+		return 0;
+
+	return strcmp(entrykey_string(k1, byname) + depth + 8, entrykey_string(k2, byname) + depth + 8);
+}
+
+void entrykey_insertionsort(struct entrykey *keys, size_t n, size_t depth, int byname)
+{
+	size_t x;
+	for (x = 1; x < n; ++x)
+	{
+		struct entrykey key = keys[x];
+
+		size_t y = x;
+		while (y > 0 && entrykey_compare(&key, &keys[y - 1], depth, byname) < 0)
+		{
+			keys[y] = keys[y - 1];
+			--y;
+		}
+
+		keys[y] = key;
+	}
+}
+
+/*
+ * Rearrange keys in place into 256 buckets by byte number byte of their
+ * prefixes, counting from the most significant. Only buckets first to last
+ * can be nonempty, and bucket c of those ends up between bounds[c] and
+ * bounds[c + 1].
+ */
+void entrykey_distribute(struct entrykey *keys, size_t n, int byte, size_t *bounds, int *first, int *last)
+{
+	const int shift = 56 - 8 * byte;
+
+	size_t counts[256];
+	memset(counts, 0, sizeof(counts));
+
+	int lowest = 255;
+	int highest = 0;
+
+	size_t x;
+	for (x = 0; x < n; ++x)
+	{
+		const int c = (keys[x].prefix >> shift) & 0xff;
+
+		++counts[c];
+
+		if (c < lowest)
+			lowest = c;
+		if (c > highest)
+			highest = c;
+	}
+
+	*first = lowest;
+	*last = highest;
+
+	size_t next[256];
+
+	int c;
+	bounds[lowest] = 0;
+	for (c = lowest; c <= highest; ++c)
+	{
+		next[c] = bounds[c];
+		bounds[c + 1] = bounds[c] + counts[c];
+	}
+
+	/* Everything is in one bucket already. */
+	if (lowest == highest)
+		return;
+
+	for (c = lowest; c <= highest; ++c)
+	{
+		while (next[c] < bounds[c + 1])
+		{
+			struct entrykey key = keys[next[c]];
+			int d = (key.prefix >> shift) & 0xff;
+
+			/* Swap the key into its bucket until one that belongs here turns up. */
+			while (d != c)
+			{
+				struct entrykey swap = keys[next[d]];
+				keys[next[d]++] = key;
+
+				key = swap;
+				d = (key.prefix >> shift) & 0xff;
+			}
+
+			keys[next[c]++] = key;
+		}
+	}
+}
+
+/* Replace the prefixes of keys with the eight bytes of their strings that follow depth + 8. */
+void entrykey_rekey(struct entrykey *keys, size_t n, size_t depth, int byname)
+{
+	size_t x;
+	for (x = 0; x < n; ++x)
+		keys[x].prefix = stringprefix(entrykey_string(&keys[x], byname) + depth + 8);
+}
+
+/* Find the first byte of the prefixes, from byte on, on which keys differ, or 8 if they all agree. */
+int entrykey_firstdifference(const struct entrykey *keys, size_t n, int byte)
+{
+	uint64_t differences = 0;
+
+	size_t x;
+	for (x = 1; x < n; ++x)
+		differences |= keys[x].prefix ^ keys[0].prefix;
+
+	while (byte < 8 && ((differences >> (56 - 8 * byte)) & 0xff) == 0)
+		++byte;
+
+	return byte;
+}
+
+void entrykey_sortbucket(struct entrykey *keys, size_t n, size_t depth, int byte, int byname);
+
+/*
+ * Sort keys whose strings agree on their first depth bytes and on the
+ * bytes of their prefixes before byte, in the same order as strcmp. This is
+ * an MSD radix sort over the cached prefixes, so strings are only read when
+ * eight bytes of shared prefix have been used up and the keys are given the
+ * next eight. Small buckets are finished with an insertion sort.
+ *
+ * The largest bucket is sorted by looping rather than by recursion, which
+ * keeps the recursion depth logarithmic in n however long the strings are.
+ */
+void entrykey_radixsort(struct entrykey *keys, size_t n, size_t depth, int byte, int byname)
+{
+	while (n > 1)
+	{
+		if (n <= SORT_INSERTION_MAX_SIZE)
+		{
+			entrykey_insertionsort(keys, n, depth, byname);
+			return;
+		}
+
+		/* Skip the bytes that every key shares, which long common prefixes make the usual case. */
+		byte = entrykey_firstdifference(keys, n, byte);
+
+		if (byte == 8)
+		{
+			/* Prefixes that end in a terminator are equal strings. */
+			if ((keys[0].prefix & 0xff) == 0)
+				return;
+
+			if (depth == 0)
+			{
+				/* The caller may want the first prefixes back, which entrykey_sortbucket restores. */
+				entrykey_sortbucket(keys, n, depth, 7, byname);
+				return;
+			}
+
+			entrykey_rekey(keys, n, depth, byname);
+			depth += 8;
+			byte = 0;
+			continue;
+		}
+
+		/* Hashfiles and runs are often in order already, leaving only runs of equal prefixes to sort. */
+		size_t x;
+		for (x = 1; x < n && keys[x - 1].prefix <= keys[x].prefix; ++x)
+			;
+
+		if (x == n)
+		{
+			size_t largest = 0;
+			size_t largestsize = 0;
+
+			size_t start = 0;
+			while (start < n)
+			{
+				size_t end = start + 1;
+				while (end < n && keys[end].prefix == keys[start].prefix)
+					++end;
+
+				/* A run of prefixes that end in a terminator holds equal strings. */
+				if ((keys[start].prefix & 0xff) == 0)
+					;
+				else if (end - start > largestsize)
+				{
+					if (largestsize > 1)
+						entrykey_sortbucket(keys + largest, largestsize, depth, 7, byname);
+
+					largest = start;
+					largestsize = end - start;
+				}
+				else if (end - start > 1)
+					entrykey_sortbucket(keys + start, end - start, depth, 7, byname);
+
+				start = end;
+			}
+
+			keys += largest;
+			n = largestsize;
+			byte = 8;
+			continue;
+		}
+
+		size_t bounds[257];
+		int first;
+		int last;
+		entrykey_distribute(keys, n, byte, bounds, &first, &last);
+
+		/* Bucket 0 holds strings that end here, which are all equal. */
+		if (first == 0)
+			++first;
+
+		if (first > last)
+			return;
+
+		int largest = first;
+
+		int c;
+		for (c = first + 1; c <= last; ++c)
+			if (bounds[c + 1] - bounds[c] > bounds[largest + 1] - bounds[largest])
+				largest = c;
+
+		for (c = first; c <= last; ++c)
+			if (c != largest && bounds[c + 1] - bounds[c] > 1)
+				entrykey_sortbucket(keys + bounds[c], bounds[c + 1] - bounds[c], depth, byte, byname);
+
+		keys += bounds[largest];
+		n = bounds[largest + 1] - bounds[largest];
+		++byte;
+	}
+}
+
+/*
+ * Sort a bucket of keys that agree on their prefixes up to and including
+ * byte. The prefixes are as they were on return.
+ */
+void entrykey_sortbucket(struct entrykey *keys, size_t n, size_t depth, int byte, int byname)
+{
+	if (byte < 7)
+	{
+		entrykey_radixsort(keys, n, depth, byte + 1, byname);
+		return;
+	}
+
+	const uint64_t prefix = keys[0].prefix;
+
+	entrykey_rekey(keys, n, depth, byname);
+	entrykey_radixsort(keys, n, depth + 8, 0, byname);
+
+	size_t x;
+	for (x = 0; x < n; ++x)
+		keys[x].prefix = prefix;
+}
+
+struct sorttask
+{
+	struct entrykey *keys;
+	size_t n;
+	size_t depth;
+	int byte;
+};
+
+/* Keys whose prefixes were replaced while splitting, and the prefix they had. */
+struct sortrestore
+{
+	struct entrykey *keys;
+	size_t n;
+	uint64_t prefix;
+};
+
+struct sortqueue
+{
+	struct sorttask *tasks;
+	size_t count;
+	size_t allocated;
+	size_t next;
+	int byname;
+	struct sortrestore *restores;
+	size_t restorecount;
+	pthread_mutex_t lock;
+};
+
+int sorttask_comparebysize(const void *t1, const void *t2)
+{
+	const struct sorttask *c1 = t1;
+	const struct sorttask *c2 = t2;
+
+	if (c1->n != c2->n)
+		return c1->n > c2->n ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Queue keys that agree on their prefixes before byte. If byte is 8 they are
+ * given their next eight bytes first, and their prefixes are remembered so
+ * that they can be put back once sorted.
+ */
+void sortqueue_add(struct sortqueue *q, struct entrykey *keys, size_t n, size_t depth, int byte)
+{
+	if (byte == 8)
+	{
+		struct sortrestore *restores = realloc(q->restores, sizeof(struct sortrestore) * (q->restorecount + 1));
+		if (!restores)
+			fatalerror("out of memory!");
+
+		q->restores = restores;
+		q->restores[q->restorecount].keys = keys;
+		q->restores[q->restorecount].n = n;
+		q->restores[q->restorecount].prefix = keys[0].prefix;
+		++q->restorecount;
+
+		entrykey_rekey(keys, n, depth, q->byname);
+		depth += 8;
+		byte = 0;
+	}
+
+	if (q->count == q->allocated)
+	{
+		struct sorttask *tasks = realloc(q->tasks, sizeof(struct sorttask) * q->allocated * 2);
+		if (!tasks)
+			fatalerror("out of memory!");
+
+		q->allocated *= 2;
+		q->tasks = tasks;
+	}
+
+	q->tasks[q->count].keys = keys;
+	q->tasks[q->count].n = n;
+	q->tasks[q->count].depth = depth;
+	q->tasks[q->count].byte = byte;
+	++q->count;
+}
+
+void *sortqueue_worker(void *arg)
+{
+	struct sortqueue *q = arg;
+
+	while (1)
+	{
+		pthread_mutex_lock(&q->lock);
+		size_t x = q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (x >= q->count)
+			return 0;
+
+		struct sorttask *task = &q->tasks[x];
+		entrykey_radixsort(task->keys, task->n, task->depth, task->byte, q->byname);
+	}
+}
+
+/*
+ * Sort keys as entrykey_radixsort does, using threadcount threads. The
+ * largest buckets are split in this thread until no bucket holds much more
+ * than its share of the keys, and the buckets are then sorted concurrently,
+ * largest first.
+ */
+void entrykey_sortinparallel(struct entrykey *keys, size_t n, int byname, int threadcount)
+{
+	struct sortqueue q;
+
+	q.allocated = 256;
+	q.tasks = malloc(sizeof(struct sorttask) * q.allocated);
+	if (!q.tasks)
+		fatalerror("out of memory!");
+
+	q.count = 0;
+	q.next = 0;
+	q.byname = byname;
+	q.restores = 0;
+	q.restorecount = 0;
+
+	sortqueue_add(&q, keys, n, 0, 0);
+
+	const size_t share = n / ((size_t)threadcount * 2);
+
+	while (q.count > 0)
+	{
+		size_t largest = 0;
+
+		size_t x;
+		for (x = 1; x < q.count; ++x)
+			if (q.tasks[x].n > q.tasks[largest].n)
+				largest = x;
+
+		if (q.tasks[largest].n <= MAX(share, SORT_INSERTION_MAX_SIZE))
+			break;
+
+		struct sorttask task = q.tasks[largest];
+		q.tasks[largest] = q.tasks[--q.count];
+
+		int byte = entrykey_firstdifference(task.keys, task.n, task.byte);
+
+		if (byte == 8)
+		{
+			/* Prefixes that end in a terminator are equal strings. */
+			if ((task.keys[0].prefix & 0xff) != 0)
+				sortqueue_add(&q, task.keys, task.n, task.depth, 8);
+
+			continue;
+		}
+
+		size_t bounds[257];
+		int first;
+		int last;
+		entrykey_distribute(task.keys, task.n, byte, bounds, &first, &last);
+
+		int c;
+		for (c = MAX(first, 1); c <= last; ++c)
+			if (bounds[c + 1] - bounds[c] > 1)
+				sortqueue_add(&q, task.keys + bounds[c], bounds[c + 1] - bounds[c], task.depth, byte + 1);
+	}
+
+	qsort(q.tasks, q.count, sizeof(struct sorttask), sorttask_comparebysize);
+
+	if (pthread_mutex_init(&q.lock, 0) != 0)
+		fatalerror("could not initialize sort queue");
+
+	/* The sorting threads share q, and this thread is one of them. */
+	char **deferred = loaderror;
+	loaderror = 0;
+
+	pthread_t *threads = malloc(sizeof(pthread_t) * threadcount);
+	if (!threads)
+		fatalerror("out of memory!");
+
+	int t;
+	for (t = 1; t < threadcount; ++t)
+		if (pthread_create(&threads[t], 0, sortqueue_worker, &q) != 0)
+			fatalerror("could not create sorting thread");
+
+	sortqueue_worker(&q);
+
+	for (t = 1; t < threadcount; ++t)
+		pthread_join(threads[t], 0);
+
+	loaderror = deferred;
+
+	pthread_mutex_destroy(&q.lock);
+
+	/* Restore prefixes innermost first, so that the first prefixes win. */
+	while (q.restorecount > 0)
+	{
+		struct sortrestore *r = &q.restores[--q.restorecount];
+
+		size_t x;
+		for (x = 0; x < r->n; ++x)
+			r->keys[x].prefix = r->prefix;
+	}
+
+	free(q.restores);
+	free(threads);
+	free(q.tasks);
+}
+
+/* Digit values plus one, so that zero marks characters that are not hex digits. */
+static const unsigned char hexvalues[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+char *skipspaces(char *p)
+{
+	while (*p == ' ')
+		++p;
+
+	return p;
+}
+
+char *tokenend(char *p)
+{
+	while (*p != ' ' && *p != '\0')
+		++p;
+
+	return p;
+}
+
+/* Parse a whole space-delimited decimal token at *p, advancing past it and the spaces after it. */
+int parseunsignedtoken(char **p, uint64_t *value)
+{
+	char *q = *p;
+	uint64_t v = 0;
+
+	if (*q < '0' || *q > '9')
+		return 0;
+
+	for (; *q >= '0' && *q <= '9'; ++q)
+	{
+		unsigned digit = *q - '0';
+
+		if (v > (UINT64_MAX - digit) / 10)
+			return 0;
+
+		v = v * 10 + digit;
+	}
+
+	if (*q != ' ' && *q != '\0')
+		return 0;
+
+	*value = v;
+	*p = skipspaces(q);
+
+	return 1;
+}
+
+int parsesignedtoken(char **p, int64_t *value)
+{
+	int negative = **p == '-';
+	char *q = *p + negative;
+	uint64_t magnitude;
+
+	if (!parseunsignedtoken(&q, &magnitude) || magnitude > (uint64_t)INT64_MAX + negative)
+		return 0;
+
+	*value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+	*p = q;
+
+	return 1;
+}
+
+/*
+ * Decode a digest byte the way earlier versions did, with sscanf's %x, which
+ * also takes pairs such as "+f" or "eg". Only used for pairs that are not two
+ * hex digits, so that files those versions accepted are still accepted.
+ */
+int parsedigestpair(const char *pair, unsigned char *byte)
+{
+	if (pair[0] == ' ' || pair[0] == '\0' || pair[1] == ' ' || pair[1] == '\0')
+		return 0;
+
+	char bs[3] = { pair[0], pair[1], '\0' };
+	unsigned int uib;
+
+	if (sscanf(bs, "%x", &uib) != 1)
+		return 0;
+
+	*byte = (unsigned char)uib;
+
+	return 1;
+}
+
+/* Decode the 64 hex digits of a SHA-256 digest, which must make up the whole token at *p. */
+int parsedigesttoken(char **p, unsigned char *hash)
+{
+	char *q = *p;
+
+	int x;
+	for (x = 0; x < SHA256_BYTES_SIZE; ++x)
+	{
+		unsigned char high = hexvalues[(unsigned char)q[x * 2]];
+		unsigned char low = high ? hexvalues[(unsigned char)q[x * 2 + 1]] : 0;
+
+		if (low)
+			hash[x] = (unsigned char)((high - 1) << 4 | (low - 1));
+		else if (!parsedigestpair(q + x * 2, &hash[x]))
+			return 0;
+	}
+
+	q += SHA256_BYTES_SIZE * 2;
+
+	if (*q != ' ' && *q != '\0')
+		return 0;
+
+	*p = skipspaces(q);
+
+	return 1;
+}
+
+/* Read the size, mtime_ns, ctime_ns, inode and device fields of a DIRHASH3 line. */
+int parsemetadatatokens(char **p, struct directoryentry *entry)
+{
+	return parseunsignedtoken(p, &entry->size) &&
+		parsesignedtoken(p, &entry->mtime_ns) &&
+		parsesignedtoken(p, &entry->ctime_ns) &&
+		parseunsignedtoken(p, &entry->inode) &&
+		parseunsignedtoken(p, &entry->device);
+}
+
+/*
+ * Parse a NUL-terminated hashfile line in the given format version into
+ * entry, copying its full path into paths. Returns 1 on success, 0 for
+ * blank lines and entries outside root, and -1 on errors.
+ */
+int directoryentry_parseline(char *line, struct directoryentry *entry, char *root, int version, struct patharena *paths)
+{
+	char *p = skipspaces(line);
+	char *end = tokenend(p);
+
+	if (end == p)
+		return 0;
+
+	if (end - p != 1 || (*p != 'R' && *p != 'D'))
+		return -1;
+
+	entry->type = *p == 'R' ? DT_REG : DT_DIR;
+	entry->size = 0;
+	entry->mtime_ns = 0;
+	entry->ctime_ns = 0;
+	entry->inode = 0;
+	entry->device = 0;
+
+	p = skipspaces(end);
+
+	if (entry->type == DT_REG && !parsedigesttoken(&p, entry->hash))
+		return -1;
+
+	if (version >= 3 && !parsemetadatatokens(&p, entry))
+		return -1;
+
+	/* The path is the rest of the line. */
+	char *rpath = p;
+
+	if (root != 0)
+		rpath = relativepath(p, root);
+
+	if (!rpath)
+		return 0;
+
+	entry->fullpath = patharena_copy(paths, p, strlen(p));
+	if (!entry->fullpath)
+		fatalerror("out of memory!");
+
+	entry->nameoffset = rpath - p;
+
+	return 1;
+}
+
+/* Return the next line without its newline, or 0 at the end of the file. */
+char *hashfilereader_readline(struct hashfilereader *r)
+{
+	while (1)
+	{
+		char *line = r->buffer + r->start;
+		char *newline = memchr(line, '\n', r->end - r->start);
+
+		if (newline != 0)
+		{
+			*newline = '\0';
+			r->start = newline + 1 - r->buffer;
+			return line;
+		}
+
+		/* Move the partial line to the front, growing the buffer if it fills it, and read more. */
+		memmove(r->buffer, line, r->end - r->start);
+		r->end -= r->start;
+		r->start = 0;
+
+		if (r->end == r->size)
+		{
+			r->size *= 2;
+			r->buffer = realloc(r->buffer, r->size);
+			if (!r->buffer)
+				fatalerror("out of memory!");
+		}
+
+		size_t read = bufferedfile_getbytes_unbuffered(r->buffer + r->end, r->size - r->end, r->bfile);
+
+		/* As ever, a last line without a newline is ignored. */
+		if (read == 0)
+			return 0;
+
+		r->end += read;
+	}
+}
+
+/*
+ * Start reading the text hashfile in bfile, whose header line may carry
+ * flags after the version. Returns 0, with bfile rewound, if it is not one.
+ */
+struct hashfilereader *hashfilereader_new(struct BUFFEREDFILE *bfile, char *path, char *root, size_t buffersize)
+{
+	uint8_t buf[10];
+	if (bufferedfile_getbytes(buf, 9, bfile) != 9)
+	{
+		bufferedfile_ungetbytes(bfile);
+		return 0;
+	}
+
+	buf[9] = '\0';
+
+	int version = 0;
+	int hasflags = 0;
+	if (strcmp((char*)buf, "DIRHASH2\n") == 0)
+		version = 2;
+	else if (strcmp((char*)buf, "DIRHASH3\n") == 0)
+		version = 3;
+	else if (strcmp((char*)buf, "DIRHASH3 ") == 0)
+	{
+		version = 3;
+		hasflags = 1;
+	}
+
+	if (version == 0)
+	{
+		bufferedfile_ungetbytes(bfile);
+		return 0;
+	}
+
+	struct hashfilereader *r = malloc(sizeof(struct hashfilereader));
+	if (!r)
+		fatalerror("out of memory!");
+
+	r->bfile = bfile;
+	r->path = path;
+	r->root = root;
+	r->version = version;
+	r->sorted = 0;
+	r->verbose = ISFLAG(flags, F_VERBOSE);
+	r->headersize = 9;
+	r->lineno = 0;
+	r->foundone = 0;
+	r->size = buffersize;
+	r->start = 0;
+	r->end = 0;
+
+	r->buffer = malloc(r->size);
+	if (!r->buffer)
+		fatalerror("out of memory!");
+
+	if (hasflags)
+	{
+		char *line = hashfilereader_readline(r);
+		if (!line)
+			fatalerror("hashfile '%s' has an incomplete header", path);
+
+		r->headersize += strlen(line) + 1;
+
+		/* Flags this version does not know are ignored. */
+		char *p = skipspaces(line);
+		while (*p != '\0')
+		{
+			char *end = tokenend(p);
+
+			if (end - p == 6 && memcmp(p, "sorted", 6) == 0)
+				r->sorted = 1;
+
+			p = skipspaces(end);
+		}
+	}
+
+	return r;
+}
+
+/* Read the next entry below the reader's root, its path going into paths. Returns 0 at the end of the file. */
+int hashfilereader_next(struct hashfilereader *r, struct directoryentry *entry, struct patharena *paths)
+{
+	char *line;
+	while ((line = hashfilereader_readline(r)) != 0)
+	{
+		++r->lineno;
+
+		const int result = directoryentry_parseline(line, entry, r->root, r->version, paths);
+
+		if (result == 1) {
+			r->foundone = 1;
+
+			if (r->verbose)
+				fprintf(stderr, "[%s] %s\n", r->path, entry->fullpath);
+
+			return 1;
+		}
+		else if (result == -1) {
+			fatalerror("hashfile contains errors in line %zu:\n\"%s\"", r->lineno, line);
+		}
+	}
+
+	if (r->root && !r->foundone)
+		fatalerror("directory %s not found in %s", r->root, r->path);
+
+	return 0;
+}
+
+void hashfilereader_free(struct hashfilereader *r)
+{
+	free(r->buffer);
+	free(r);
+}
+
+/* Fill in the snapshot record for de, whose path is at pathoffset in the path table. */
+void snapshotrecord_set(struct snapshotrecord *record, const struct directoryentry *de, uint64_t pathoffset)
+{
+	memset(record, 0, sizeof(struct snapshotrecord));
+
+	record->pathoffset = pathoffset;
+	record->size = de->size;
+	record->mtime_ns = de->mtime_ns;
+	record->ctime_ns = de->ctime_ns;
+	record->inode = de->inode;
+	record->device = de->device;
+	record->type = de->type;
+
+	if (de->type == DT_REG)
+		memcpy(record->hash, de->hash, SHA256_BYTES_SIZE);
+}
+
+/*
+ * Read the next entry of run into entry, copying its path into paths and
+ * taking its name relative to root. Returns 0 at the end of the run.
+ */
+int spillrun_next(struct spillrun *run, char *root, struct directoryentry *entry, struct patharena *paths, char **buffer, size_t *allocated)
+{
+	struct snapshotrecord record;
+
+	if (fread(&record, sizeof(record), 1, run->records) != 1)
+	{
+		if (ferror(run->records))
+			fatalerror("error reading temporary file");
+
+		return 0;
+	}
+
+	ssize_t length = getdelim(buffer, allocated, '\0', run->paths);
+	if (length <= 0 || (*buffer)[length - 1] != '\0')
+		fatalerror("error reading temporary file");
+
+	char *fullpath = patharena_alloc(paths, length);
+	if (!fullpath)
+		fatalerror("out of memory!");
+
+	memcpy(fullpath, *buffer, length);
+
+	/* Only entries below root were spilled, so this always finds the name. */
+	char *rpath = relativepath(fullpath, root);
+
+	entry->fullpath = fullpath;
+	entry->nameoffset = rpath ? rpath - fullpath : 0;
+	entry->type = record.type;
+	memcpy(entry->hash, record.hash, SHA256_BYTES_SIZE);
+	entry->size = record.size;
+	entry->mtime_ns = record.mtime_ns;
+	entry->ctime_ns = record.ctime_ns;
+	entry->inode = record.inode;
+	entry->device = record.device;
+
+	return 1;
+}
+
+/* Order the current entries of two cursors by name, comparing their prefixes first. */
+int entrycursor_order(const struct entrycursor *c1, const struct entrycursor *c2)
+{
+	if (c1->key != c2->key)
+		return c1->key < c2->key ? -1 : 1;
+
+	/* Equal prefixes that end in a terminator are equal names. */
+	if ((c1->key & 0xff) == 0)
+		return 0;
+
+	return strcmp(ENTRYNAME(c1->current) + 8, ENTRYNAME(c2->current) + 8);
+}
+
+int entrycursor_heapbefore(struct entrycursor *c, size_t a, size_t b)
+{
+	return entrycursor_order(&c->sources[c->heap[a]], &c->sources[c->heap[b]]) < 0;
+}
+
+void entrycursor_heapdown(struct entrycursor *c, size_t i)
+{
+	while (1)
+	{
+		size_t smallest = i;
+		size_t left = 2 * i + 1;
+		size_t right = 2 * i + 2;
+
+		if (left < c->heapsize && entrycursor_heapbefore(c, left, smallest))
+			smallest = left;
+
+		if (right < c->heapsize && entrycursor_heapbefore(c, right, smallest))
+			smallest = right;
+
+		if (smallest == i)
+			return;
+
+		size_t swap = c->heap[i];
+		c->heap[i] = c->heap[smallest];
+		c->heap[smallest] = swap;
+
+		i = smallest;
+	}
+}
+
+void entrycursor_advance(struct entrycursor *c)
+{
+	if (c->sources)
+	{
+		struct entrycursor *top = &c->sources[c->heap[0]];
+
+		entrycursor_advance(top);
+
+		if (!top->current)
+			c->heap[0] = c->heap[--c->heapsize];
+
+		if (c->heapsize > 0)
+			entrycursor_heapdown(c, 0);
+
+		if (c->heapsize > 0)
+		{
+			c->current = c->sources[c->heap[0]].current;
+			c->key = c->sources[c->heap[0]].key;
+		}
+		else
+			c->current = 0;
+
+		return;
+	}
+
+	if (c->collection)
+	{
+		struct directoryentrycollection *collection = c->collection;
+
+		if (c->position == collection->length)
+		{
+			c->current = 0;
+			return;
+		}
+
+		c->current = &collection->entries[c->position];
+		c->key = collection->prefixes ? collection->prefixes[c->position] : stringprefix(ENTRYNAME(c->current));
+		++c->position;
+		return;
+	}
+
+	struct directoryentry next;
+	struct patharena *paths = c->paths[0];
+
+	patharena_reset(paths);
+
+	if (c->run)
+	{
+		if (!spillrun_next(c->run, c->root, &next, paths, &c->pathbuffer, &c->pathallocated))
+		{
+			c->current = 0;
+			return;
+		}
+
+		c->entry = next;
+		c->current = &c->entry;
+		c->key = stringprefix(ENTRYNAME(c->current));
+
+		c->paths[0] = c->paths[1];
+		c->paths[1] = paths;
+		return;
+	}
+
+	if (!hashfilereader_next(c->reader, &next, paths))
+	{
+		c->current = 0;
+		return;
+	}
+
+	/* A merge join over entries out of order would report nonsense. */
+	if (c->current && strcmp(ENTRYNAME(&next), ENTRYNAME(c->current)) < 0)
+		fatalerror("hashfile '%s' is not sorted at line %zu", c->reader->path, c->reader->lineno);
+
+	c->entry = next;
+	c->current = &c->entry;
+	c->key = stringprefix(ENTRYNAME(c->current));
+
+	c->paths[0] = c->paths[1];
+	c->paths[1] = paths;
+}
+
+void entrycursor_initreader(struct entrycursor *c, struct hashfilereader *reader, struct spillrun *run, char *root)
+{
+	memset(c, 0, sizeof(struct entrycursor));
+	c->reader = reader;
+	c->run = run;
+	c->root = root;
+
+	c->paths[0] = patharena_new(PATHARENA_BLOCK_SIZE);
+	c->paths[1] = patharena_new(PATHARENA_BLOCK_SIZE);
+	if (!c->paths[0] || !c->paths[1])
+		fatalerror("out of memory!");
+
+	entrycursor_advance(c);
+}
+
+/*
+ * Walk a collection sorted by name. If it has spilled runs, they are read
+ * back and merged with the entries still in memory.
+ */
+void entrycursor_initcollection(struct entrycursor *c, struct directoryentrycollection *collection)
+{
+	memset(c, 0, sizeof(struct entrycursor));
+	c->collection = collection;
+
+	if (!collection->spill || collection->spill->runcount == 0)
+	{
+		entrycursor_advance(c);
+		return;
+	}
+
+	struct entryspill *spill = collection->spill;
+
+	c->sourcecount = spill->runcount + 1;
+	c->sources = malloc(sizeof(struct entrycursor) * c->sourcecount);
+	c->heap = malloc(sizeof(size_t) * c->sourcecount);
+	if (!c->sources || !c->heap)
+		fatalerror("out of memory!");
+
+	size_t x;
+	for (x = 0; x < spill->runcount; ++x)
+	{
+		rewind(spill->runs[x].records);
+		rewind(spill->runs[x].paths);
+
+		entrycursor_initreader(&c->sources[x], 0, &spill->runs[x], spill->root);
+	}
+
+	struct entrycursor *memory = &c->sources[spill->runcount];
+	memset(memory, 0, sizeof(struct entrycursor));
+	memory->collection = collection;
+	entrycursor_advance(memory);
+
+	for (x = 0; x < c->sourcecount; ++x)
+		if (c->sources[x].current)
+			c->heap[c->heapsize++] = x;
+
+	for (x = c->heapsize / 2; x > 0; --x)
+		entrycursor_heapdown(c, x - 1);
+
+	if (c->heapsize > 0)
+	{
+		c->current = c->sources[c->heap[0]].current;
+		c->key = c->sources[c->heap[0]].key;
+	}
+	else
+		c->current = 0;
+}
+
+/* Release what a cursor allocated for itself, including the readers it opened over spilled runs. */
+void entrycursor_free(struct entrycursor *c)
+{
+	size_t x;
+	for (x = 0; x < c->sourcecount; ++x)
+	{
+		entrycursor_free(&c->sources[x]);
+
+		if (c->sources[x].reader)
+		{
+			bufferedfile_destroy(c->sources[x].reader->bfile);
+			hashfilereader_free(c->sources[x].reader);
+		}
+	}
+
+	free(c->sources);
+	free(c->heap);
+	free(c->pathbuffer);
+
+	patharena_free(c->paths[0]);
+	patharena_free(c->paths[1]);
+}
+
+int directoryentry_comparebyfullpath(const void *de1, const void *de2)
+{
+	const struct directoryentry *c1 = de1;
+	const struct directoryentry *c2 = de2;
+
+	return strcmp(c1->fullpath, c2->fullpath);
+}
+
+/*
+ * Sort collection by name, or by full path if byname is zero. Rather than
+ * moving whole entries around, a column of 16-byte keys is sorted and the
+ * entries are then permuted into place. When sorting by name the key
+ * prefixes are kept in collection->prefixes for the merge in
+ * entrycursor_compare.
+ */
+void directoryentrycollection_sortby(struct directoryentrycollection *collection, int byname)
+{
+	size_t n = collection->length;
+
+	free(collection->prefixes);
+	collection->prefixes = 0;
+	collection->sortedbyname = byname;
+
+	if (n < 2)
+		return;
+
+	struct entrykey *keys = malloc(sizeof(struct entrykey) * n);
+	if (!keys)
+		fatalerror("out of memory!");
+
+	struct directoryentry *entries = collection->entries;
+
+	size_t e;
+	for (e = 0; e < n; ++e)
+	{
+		keys[e].prefix = stringprefix(byname ? ENTRYNAME(&entries[e]) : entries[e].fullpath);
+		keys[e].entry = &entries[e];
+	}
+
+	if (jobcount > 1 && n >= SORT_PARALLEL_MIN_SIZE)
+		entrykey_sortinparallel(keys, n, byname, jobcount);
+	else
+		entrykey_radixsort(keys, n, 0, 0, byname);
+
+	/* Follow each cycle of the permutation, marking keys whose slot has been filled. */
+	for (e = 0; e < n; ++e)
+	{
+		if (!keys[e].entry)
+			continue;
+
+		struct directoryentry saved = entries[e];
+		size_t to = e;
+
+		while (1)
+		{
+			size_t from = keys[to].entry - entries;
+			keys[to].entry = 0;
+
+			if (from == e)
+			{
+				entries[to] = saved;
+				break;
+			}
+
+			entries[to] = entries[from];
+			to = from;
+		}
+	}
+
+	if (!byname)
+	{
+		free(keys);
+		return;
+	}
+
+	/* Pack the prefixes down over the keys they came from. */
+	uint64_t *prefixes = (uint64_t *)keys;
+	for (e = 0; e < n; ++e)
+		prefixes[e] = keys[e].prefix;
+
+	collection->prefixes = realloc(prefixes, sizeof(uint64_t) * n);
+	if (!collection->prefixes)
+		collection->prefixes = prefixes;
+}
+
+void directoryentrycollection_sort(struct directoryentrycollection *collection)
+{
+	directoryentrycollection_sortby(collection, 1);
+}
+
+/* Create an anonymous temporary file in $TMPDIR, or /tmp if it is not set. */
+FILE *spillfile_new()
+{
+	const char *dir = getenv("TMPDIR");
+	if (!dir || *dir == '\0')
+		dir = "/tmp";
+
+	char *path = malloc(strlen(dir) + 32);
+	if (!path)
+		fatalerror("out of memory!");
+
+	sprintf(path, "%s/dirchanges.XXXXXX", dir);
+
+	int fd = mkstemp(path);
+	if (fd < 0)
+		fatalerror("could not create a temporary file in '%s'", dir);
+
+	unlink(path);
+	free(path);
+
+	FILE *f = fdopen(fd, "w+b");
+	if (!f)
+		fatalerror("could not create a temporary file in '%s'", dir);
+
+	return f;
+}
+
+/* Create the files of a new run and start writing sorted entries to them. */
+void spillwriter_init(struct spillwriter *w, struct spillrun *run)
+{
+	run->records = spillfile_new();
+	run->paths = spillfile_new();
+
+	w->records = outbuffer_new(fileno(run->records), SPILL_BUFFER_SIZE);
+	w->paths = outbuffer_new(fileno(run->paths), SPILL_BUFFER_SIZE);
+	if (!w->records || !w->paths)
+		fatalerror("out of memory!");
+
+	w->offset = 0;
+}
+
+void spillwriter_add(struct spillwriter *w, const struct directoryentry *de)
+{
+	struct snapshotrecord record;
+	size_t length = strlen(de->fullpath) + 1;
+
+	snapshotrecord_set(&record, de, w->offset);
+
+	outbuffer_write(w->records, &record, sizeof(record));
+	outbuffer_write(w->paths, de->fullpath, length);
+
+	w->offset += length;
+}
+
+void spillwriter_finish(struct spillwriter *w)
+{
+	if (!outbuffer_flush(w->records) || !outbuffer_flush(w->paths))
+		fatalerror("error writing temporary file");
+
+	outbuffer_free(w->records);
+	outbuffer_free(w->paths);
+}
+
+/*
+ * Under --max-memory, limit a collection loaded for comparison to about half
+ * the budget, since both sides are held at once. root is the -w directory
+ * the entries were taken from.
+ */
+void directoryentrycollection_setbudget(struct directoryentrycollection *collection, char *root)
+{
+	if (maxmemory == 0 || ISFLAG(flags, F_PRINTHASHES))
+		return;
+
+	collection->spill = malloc(sizeof(struct entryspill));
+	if (!collection->spill)
+		fatalerror("out of memory!");
+
+	collection->spill->maxbytes = maxmemory / 2;
+	collection->spill->root = root;
+	collection->spill->runs = 0;
+	collection->spill->runcount = 0;
+}
+
+/*
+ * Merge all the runs of an empty collection into one, so that only a bounded
+ * number of temporary files is ever open.
+ */
+void directoryentrycollection_mergeruns(struct directoryentrycollection *collection)
+{
+	struct entryspill *spill = collection->spill;
+	struct entrycursor cursor;
+	struct spillrun merged;
+	struct spillwriter w;
+
+	spillwriter_init(&w, &merged);
+
+	entrycursor_initcollection(&cursor, collection);
+
+	for (; cursor.current; entrycursor_advance(&cursor))
+		spillwriter_add(&w, cursor.current);
+
+	entrycursor_free(&cursor);
+
+	spillwriter_finish(&w);
+
+	size_t x;
+	for (x = 0; x < spill->runcount; ++x)
+	{
+		fclose(spill->runs[x].records);
+		fclose(spill->runs[x].paths);
+	}
+
+	spill->runs[0] = merged;
+	spill->runcount = 1;
+}
+
+/* Sort the entries in memory and write them out as a new run, emptying the collection. */
+void directoryentrycollection_spill(struct directoryentrycollection *collection)
+{
+	struct entryspill *spill = collection->spill;
+
+	directoryentrycollection_sort(collection);
+
+	struct spillrun *runs = realloc(spill->runs, sizeof(struct spillrun) * (spill->runcount + 1));
+	if (!runs)
+		fatalerror("out of memory!");
+
+	spill->runs = runs;
+
+	struct spillwriter w;
+	spillwriter_init(&w, &runs[spill->runcount]);
+
+	size_t e;
+	for (e = 0; e < collection->length; ++e)
+		spillwriter_add(&w, &collection->entries[e]);
+
+	spillwriter_finish(&w);
+
+	++spill->runcount;
+
+	collection->length = 0;
+	patharena_reset(collection->paths);
+
+	free(collection->prefixes);
+	collection->prefixes = 0;
+	collection->sortedbyname = 0;
+
+	if (spill->runcount == SPILL_MAX_RUNS)
+		directoryentrycollection_mergeruns(collection);
+}
+
+/*
+ * Add what, whose path must be in to's arena, to collection, spilling the
+ * collection if that takes it over its memory budget.
+ */
+void directoryentrycollection_append(struct directoryentrycollection *to, struct directoryentry *what)
+{
+	directoryentrycollection_add(to, what);
+
+	if (to->spill && to->length * sizeof(struct directoryentry) + patharena_size(to->paths) > to->spill->maxbytes)
+		directoryentrycollection_spill(to);
+}
+
+void printdifference(const char *message, const char *path)
+{
+	outbuffer_puts(output, message);
+	outbuffer_putc(output, ' ');
+	outbuffer_puts(output, path);
+	outbuffer_putc(output, '\n');
+
+	output_check();
+}
+
+/* Report the differences between two sequences of entries ordered by name. */
+void entrycursor_compare(struct entrycursor *from, struct entrycursor *to, char *froot, char *troot)
+{
+	int differencesfound = 0;
+
+	char *added_message = 0;
+	char *removed_message = 0;
+	char *modified_message = 0;
+
+	if (!ISFLAG(flags, F_SHORTSUMMARY)) {
+		added_message    = "   Added";
+		removed_message  = " Removed";
+		modified_message = "Modified";
+	} else {
+		added_message = "+";
+		removed_message = "-";
+		modified_message = "~";
+	}
+
+	while (from->current && to->current)
+	{
+		struct directoryentry *e1 = from->current;
+		struct directoryentry *e2 = to->current;
+
+		int cmp = entrycursor_order(from, to);
+
+		if (cmp == 0)
+		{
+			if (e1->type == DT_REG && e2->type == DT_REG)
+			{
+				if (!directoryentry_equalbydigest(e1, e2))
+				{
+					differencesfound = 1;
+					printdifference(modified_message, relativepath(e2->fullpath, troot));
+				}
+			}
+			else if (e1->type != e2->type)
+			{
+				differencesfound = 1;
+				printdifference(modified_message, relativepath(e2->fullpath, troot));
+			}
+
+			entrycursor_advance(from);
+			entrycursor_advance(to);
+		}
+		else if (cmp < 0)
+		{
+			differencesfound = 1;
+			printdifference(removed_message, relativepath(e1->fullpath, froot));
+			entrycursor_advance(from);
+		}
+		else
+		{
+			differencesfound = 1;
+			printdifference(added_message, relativepath(e2->fullpath, troot));
+			entrycursor_advance(to);
+		}
+	}
+
+	if (from->current || to->current)
+	{
+		differencesfound = 1;
+
+		for (; from->current; entrycursor_advance(from))
+			printdifference(removed_message, relativepath(from->current->fullpath, froot));
+
+		for (; to->current; entrycursor_advance(to))
+			printdifference(added_message, relativepath(to->current->fullpath, troot));
+	}
+
+	if (!differencesfound)
+		outbuffer_puts(output, "No differences found.\n");
+}
+
+void directoryentrycollection_compare(struct directoryentrycollection *c1, struct directoryentrycollection *c2, char *froot, char *troot)
+{
+	struct entrycursor from;
+	struct entrycursor to;
+
+	if (!c1->sorted && !c1->sortedbyname)
+		directoryentrycollection_sort(c1);
+
+	if (!c2->sorted && !c2->sortedbyname)
+		directoryentrycollection_sort(c2);
+
+	entrycursor_initcollection(&from, c1);
+	entrycursor_initcollection(&to, c2);
+
+	entrycursor_compare(&from, &to, froot, troot);
+
+	entrycursor_free(&from);
+	entrycursor_free(&to);
+}
+
+/*
+ * Write the header of the hashfile printed by -H: DIRHASH2 unless DIRHASH3
+ * was asked for, since older versions read only DIRHASH2. Only DIRHASH3 can
+ * say the entries are sorted.
+ */
+void printhashesheader(int sorted)
+{
+	if (!ISFLAG(flags, F_V3OUTPUT))
+		outbuffer_puts(output, "DIRHASH2\n");
+	else if (sorted)
+		outbuffer_puts(output, "DIRHASH3 sorted\n");
+	else
+		outbuffer_puts(output, "DIRHASH3\n");
+}
+
+void directoryentrycollection_printhashes(struct directoryentrycollection *collection)
+{
+	if (ISFLAG(flags, F_SORTEDOUTPUT) && !collection->sorted)
+		directoryentrycollection_sortby(collection, 0);
+
+	printhashesheader(ISFLAG(flags, F_SORTEDOUTPUT) || collection->sorted);
+
+	size_t e;
+	for (e = 0; e < collection->length; ++e)
+	{
+		directoryentry_print(collection->entries + e, ISFLAG(flags, F_V3OUTPUT), output);
+		output_check();
+	}
+}
+
+/*
+ * Produce the records and then the path table of a snapshot of collection,
+ * which must be sorted by full path, feeding them to state if it is set and
+ * writing them to out otherwise.
+ */
+void directoryentrycollection_emitsnapshot(struct directoryentrycollection *collection, sha256 *state, FILE *out)
+{
+	struct snapshotrecord records[SNAPSHOT_BATCH_SIZE];
+	uint64_t offset = 0;
+	size_t e = 0;
+
+	while (e < collection->length)
+	{
+		size_t count = MIN(collection->length - e, SNAPSHOT_BATCH_SIZE);
+
+		size_t x;
+		for (x = 0; x < count; ++x, ++e)
+		{
+			struct directoryentry *de = &collection->entries[e];
+
+			snapshotrecord_set(&records[x], de, offset);
+
+			offset += strlen(de->fullpath) + 1;
+		}
+
+		if (state)
+			sha256_append(state, records, sizeof(struct snapshotrecord) * count);
+		else if (fwrite(records, sizeof(struct snapshotrecord), count, out) != count)
+			fatalerror("error writing snapshot");
+	}
+
+	for (e = 0; e < collection->length; ++e)
+	{
+		const char *path = collection->entries[e].fullpath;
+		size_t length = strlen(path) + 1;
+
+		if (state)
+			sha256_append(state, path, length);
+		else if (fwrite(path, 1, length, out) != length)
+			fatalerror("error writing snapshot");
+	}
+}
+
+/* Write collection to out as a binary snapshot, sorting it by full path first. */
+void directoryentrycollection_writesnapshot(struct directoryentrycollection *collection, FILE *out)
+{
+	struct snapshotheader header;
+	sha256 state;
+
+	if (!collection->sorted)
+		directoryentrycollection_sortby(collection, 0);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+	header.version = SNAPSHOT_VERSION;
+	header.flags = SNAPSHOT_SORTED;
+	header.count = collection->length;
+
+	size_t e;
+	for (e = 0; e < collection->length; ++e)
+		header.stringsize += strlen(collection->entries[e].fullpath) + 1;
+
+	/* Checksum everything first, since out may not be seekable. */
+	sha256_init(&state);
+	directoryentrycollection_emitsnapshot(collection, &state, 0);
+	sha256_finalize_bytes(&state, header.checksum);
+
+	if (fwrite(&header, sizeof(header), 1, out) != 1)
+		fatalerror("error writing snapshot");
+
+	directoryentrycollection_emitsnapshot(collection, 0, out);
+
+	if (fflush(out) != 0)
+		fatalerror("error writing snapshot");
+}
+
+char *path_append(struct patharena *paths, const char *path, const char *name) {
+	size_t pathlength = 0;
+	size_t namelength = strlen(name);
+
+	if (path != 0 && strcmp(path, ".") != 0)
+		pathlength = strlen(path) + 1;
+
+	char *s = patharena_alloc(paths, pathlength + namelength + 1);
+	if (!s)
+		fatalerror("out of memory!");
+
+	if (pathlength != 0)
+	{
+		memcpy(s, path, pathlength - 1);
+		s[pathlength - 1] = '/';
+	}
+
+	memcpy(s + pathlength, name, namelength + 1);
+
+	return s;
+}
+
+struct walktask *walktask_new(const char *path)
+{
+	struct walktask *task = malloc(sizeof(struct walktask));
+	if (!task)
+		fatalerror("out of memory!");
+
+	task->path.chars = 0;
+	task->path.allocated = 0;
+	if (path != 0)
+		task->path = string_fromchars(path);
+
+	task->entries = directoryentrycollection_new();
+	task->subtasks = 0;
+	task->subtaskcount = 0;
+	task->subtaskallocated = 0;
+	task->window = SIZE_MAX;
+	task->paths = 0;
+
+	return task;
+}
+
+void walktask_addsubtask(struct walktask *task, struct walktask *subtask)
+{
+	if (task->subtaskcount == task->subtaskallocated)
+	{
+		size_t allocated = task->subtaskallocated ? task->subtaskallocated * 2 : 4;
+
+		struct walktask **newsubtasks = realloc(task->subtasks, sizeof(struct walktask *) * allocated);
+		if (!newsubtasks)
+			fatalerror("out of memory!");
+
+		task->subtasks = newsubtasks;
+		task->subtaskallocated = allocated;
+	}
+
+	task->subtasks[task->subtaskcount++] = subtask;
+}
+
+void walkdeque_push(struct walkdeque *d, struct walktask *task)
+{
+	pthread_mutex_lock(&d->lock);
+
+	if (d->tail == d->allocated)
+	{
+		if (d->head > 0)
+		{
+			memmove(d->tasks, d->tasks + d->head, sizeof(struct walktask *) * (d->tail - d->head));
+			d->tail -= d->head;
+			d->head = 0;
+		}
+		else
+		{
+			size_t allocated = d->allocated ? d->allocated * 2 : 64;
+
+			struct walktask **newtasks = realloc(d->tasks, sizeof(struct walktask *) * allocated);
+			if (!newtasks)
+				fatalerror("out of memory!");
+
+			d->tasks = newtasks;
+			d->allocated = allocated;
+		}
+	}
+
+	d->tasks[d->tail++] = task;
+
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* Take the newest task (owner) or the oldest one (thief); 0 if empty. */
+struct walktask *walkdeque_take(struct walkdeque *d, int newest)
+{
+	struct walktask *task = 0;
+
+	pthread_mutex_lock(&d->lock);
+
+	if (d->head < d->tail)
+		task = newest ? d->tasks[--d->tail] : d->tasks[d->head++];
+
+	if (d->head == d->tail)
+		d->head = d->tail = 0;
+
+	pthread_mutex_unlock(&d->lock);
+
+	return task;
+}
+
+void walker_push(struct walker *w, int self, struct walktask *task)
+{
+	pthread_mutex_lock(&w->lock);
+	++w->pending;
+	++w->pushes;
+	pthread_mutex_unlock(&w->lock);
+
+	walkdeque_push(&w->deques[self], task);
+
+	pthread_cond_signal(&w->wake);
+}
+
+/*
+ * Fill in the type and metadata of entry from the file called name in the
+ * directory open as dirfd. Types other than regular files and directories
+ * are set to DT_UNKNOWN. Returns 0 if the file cannot be examined.
+ */
+int directoryentry_statat(int dirfd, const char *name, struct directoryentry *entry)
+{
+	mode_t mode;
+
+#ifdef STATX_TYPE
+	struct statx stx;
+
+	if (statx(dirfd, name, 0, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_INO, &stx) != 0)
+		return 0;
+
+	mode = stx.stx_mode;
+	entry->size = stx.stx_size;
+	entry->mtime_ns = (int64_t)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+	entry->ctime_ns = (int64_t)stx.stx_ctime.tv_sec * 1000000000 + stx.stx_ctime.tv_nsec;
+	entry->inode = stx.stx_ino;
+	entry->device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+#else
+	struct stat st;
+
+	if (fstatat(dirfd, name, &st, 0) != 0)
+		return 0;
+
+	mode = st.st_mode;
+	entry->size = st.st_size;
+	entry->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	entry->ctime_ns = (int64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+	entry->inode = st.st_ino;
+	entry->device = st.st_dev;
+#endif
+
+	if (S_ISREG(mode))
+		entry->type = DT_REG;
+	else if (S_ISDIR(mode))
+		entry->type = DT_DIR;
+	else
+		entry->type = DT_UNKNOWN;
+
+	return 1;
+}
+
+/*
+ * Copy the digest for entry from previous, a collection sorted by full path,
+ * if it has a regular file at the same path with the same size, mtime and
+ * ctime. Returns 0 if the file needs hashing.
+ */
+int directoryentry_reusehash(struct directoryentry *entry, struct directoryentrycollection *previous)
+{
+	struct directoryentry *old = bsearch(entry, previous->entries, previous->length, sizeof(struct directoryentry), directoryentry_comparebyfullpath);
+
+	/* A zero ctime means the snapshot did not record metadata for the file. */
+	if (old == 0 || old->type != DT_REG || old->ctime_ns == 0)
+		return 0;
+
+	/*
+	 * A file changed within a timestamp tick of the snapshot being written
+	 * may have changed again after it was hashed without its times moving.
+	 */
+	if (old->ctime_ns >= reusetime_ns - REUSE_RACY_MARGIN_NS)
+		return 0;
+
+	if (old->size != entry->size || old->mtime_ns != entry->mtime_ns || old->ctime_ns != entry->ctime_ns)
+		return 0;
+
+	memcpy(entry->hash, old->hash, SHA256_BYTES_SIZE);
+
+	return 1;
+}
+
+/*
+ * List one directory, queueing a subtask for each subdirectory found. The
+ * directory is opened relative to the walk's root and everything inside it
+ * relative to the directory itself.
+ */
+void walker_run(struct walkerthread *t, struct walktask *task)
+{
+	struct walker *w = t->walker;
+	char *path = task->path.chars;
+	char *root = w->root;
+
+	int dirfd = openat(w->rootfd, path != 0 ? path : ".", O_RDONLY | O_DIRECTORY);
+
+	if (dirfd < 0 || dirreader_open(t->reader, dirfd) != 1)
+	{
+		warn("could not open %s", path);
+		return;
+	}
+
+	struct dirreader_entry dirinfo;
+	int result;
+	while ((result = dirreader_next(t->reader, &dirinfo)) == 1)
+	{
+		if (dirinfo.type != DT_DIR && dirinfo.type != DT_REG && dirinfo.type != DT_UNKNOWN)
+			continue;
+
+		struct directoryentry entry;
+		if (!directoryentry_statat(dirfd, dirinfo.name, &entry))
+		{
+			warn("could not read from '%s'", dirinfo.name);
+			continue;
+		}
+
+		if (entry.type != DT_DIR && entry.type != DT_REG)
+			continue;
+
+		char *fullpath = path_append(t->paths, path, dirinfo.name);
+
+		char *rpath = fullpath;
+		if (root != 0)
+			rpath = relativepath(fullpath, root);
+
+		if (entry.type == DT_DIR)
+		{
+			struct walktask *subtask = walktask_new(fullpath);
+
+			walktask_addsubtask(task, subtask);
+
+			/* A walk without deques lists subdirectories itself, in order. */
+			if (w->deques != 0)
+				walker_push(w, t->id, subtask);
+		}
+
+		if (rpath != 0)
+		{
+			if (ISFLAG(flags, F_VERBOSE))
+			{
+				if (w->verbosepath != 0 && strcmp(w->verbosepath, ".") != 0)
+					fprintf(stderr, "%s/%s\n", w->verbosepath, fullpath);
+				else
+					fprintf(stderr, "%s\n", fullpath);
+			}
+
+			entry.fullpath = fullpath;
+			entry.nameoffset = rpath - fullpath;
+
+			if (entry.type == DT_REG)
+			{
+				struct hashcache_key key;
+
+				if (reusecollection != 0 && directoryentry_reusehash(&entry, reusecollection))
+				{
+					++t->reused;
+					directoryentrycollection_add(task->entries, &entry);
+					continue;
+				}
+
+				if (hashcache != 0)
+				{
+					directoryentry_getcachekey(&entry, &key);
+
+					if (hashcache_lookup(hashcache, &key, entry.hash))
+					{
+						++t->cached;
+						directoryentrycollection_add(task->entries, &entry);
+						continue;
+					}
+				}
+
+				++t->rehashed;
+			}
+
+			directoryentrycollection_add(task->entries, &entry);
+
+			if (entry.type == DT_REG)
+				hashqueue_add(w->hashes, dirfd, dirinfo.name, task->entries, task->entries->length - 1);
+		}
+	}
+
+	if (result == DIRREADER_ERROR)
+		warn("could not read %s", path);
+
+	dirreader_close(t->reader);
+}
+
+void *walker_thread(void *arg)
+{
+	struct walkerthread *t = arg;
+	struct walker *w = t->walker;
+
+	while (1)
+	{
+		pthread_mutex_lock(&w->lock);
+		size_t pushes = w->pushes;
+		pthread_mutex_unlock(&w->lock);
+
+		/* Work depth-first on our own tasks, else steal the oldest elsewhere. */
+		struct walktask *task = walkdeque_take(&w->deques[t->id], 1);
+
+		int x;
+		for (x = 1; task == 0 && x < w->threadcount; ++x)
+			task = walkdeque_take(&w->deques[(t->id + x) % w->threadcount], 0);
+
+		if (task == 0)
+		{
+			pthread_mutex_lock(&w->lock);
+
+			if (w->pending == 0)
+			{
+				pthread_mutex_unlock(&w->lock);
+				break;
+			}
+
+			/* Sleep only if nothing was queued since we looked. */
+			if (w->pushes == pushes)
+				pthread_cond_wait(&w->wake, &w->lock);
+
+			pthread_mutex_unlock(&w->lock);
+
+			continue;
+		}
+
+		walker_run(t, task);
+
+		pthread_mutex_lock(&w->lock);
+		if (--w->pending == 0)
+			pthread_cond_broadcast(&w->wake);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return 0;
+}
+
+/* Free task, whose entries' paths belong to the walk or to task->paths. */
+void walktask_free(struct walktask *task)
+{
+	task->entries->length = 0;
+	directoryentrycollection_free(task->entries);
+
+	patharena_free(task->paths);
+	string_free(task->path);
+	free(task->subtasks);
+	free(task);
+}
+
+/*
+ * Compare path with everything under directory, that is, with directory plus
+ * a slash. If isdirectory is set, path is taken to end in a slash as well.
+ */
+int comparewithdirectory(const char *path, int isdirectory, const char *directory)
+{
+	const unsigned char *s1 = (const unsigned char*)path;
+	const unsigned char *s2 = (const unsigned char*)directory;
+
+	while (*s1 != 0 && *s1 == *s2)
+	{
+		++s1;
+		++s2;
+	}
+
+	int c1 = *s1 != 0 || !isdirectory ? *s1 : '/';
+	int c2 = *s2 != 0 ? *s2 : '/';
+
+	if (c1 != c2 || *s1 == 0)
+		return c1 - c2;
+
+	return *s1 - *s2;
+}
+
+int walktask_comparebypath(const void *t1, const void *t2)
+{
+	const struct walktask *w1 = *(struct walktask * const *)t1;
+	const struct walktask *w2 = *(struct walktask * const *)t2;
+
+	return comparewithdirectory(w1->path.chars, 1, w2->path.chars);
+}
+
+/*
+ * Move the entries found under task into collection in strcmp order of full
+ * path, dropping entries whose file could not be hashed, and free the task.
+ * Entries and subdirectories are each sorted, then merged so that everything
+ * under a subdirectory comes out where its path plus a slash would sort:
+ * "a", "a-b", "a.txt", then "a/b", then "a0". Returns nonzero if task or
+ * any subtask found an entry.
+ */
+int walktask_collect(struct walktask *task, struct directoryentrycollection *collection)
+{
+	struct directoryentrycollection *entries = task->entries;
+	int foundone = entries->length > 0;
+	size_t e = 0;
+	size_t x;
+
+	directoryentrycollection_sortby(entries, 0);
+
+	qsort(task->subtasks, task->subtaskcount, sizeof(struct walktask *), walktask_comparebypath);
+
+	for (x = 0; x <= task->subtaskcount; ++x)
+	{
+		for (; e < entries->length; ++e)
+		{
+			struct directoryentry *entry = &entries->entries[e];
+
+			if (x < task->subtaskcount && comparewithdirectory(entry->fullpath, 0, task->subtasks[x]->path.chars) > 0)
+				break;
+
+			if (entry->type == DT_UNKNOWN)
+				continue;
+
+			/* A collection that may spill must own the paths it holds. */
+			if (collection->spill)
+			{
+				entry->fullpath = patharena_copy(collection->paths, entry->fullpath, strlen(entry->fullpath));
+				if (!entry->fullpath)
+					fatalerror("out of memory!");
+			}
+
+			directoryentrycollection_append(collection, entry);
+		}
+
+		if (x < task->subtaskcount)
+			foundone = walktask_collect(task->subtasks[x], collection) | foundone;
+	}
+
+	walktask_free(task);
+
+	return foundone;
+}
+
+/*
+ * Walk the directory open as rootfd with threadcount threads, each subdirectory
+ * becoming a task that idle threads can steal, and add what is found to
+ * collection. Returns nonzero if anything was found.
+ */
+int directoryentry_addfromfilesystem(struct directoryentrycollection *collection, int rootfd, char *root, char *verbosepath, int threadcount)
+{
+	struct walker w;
+	struct walkerthread *threads;
+	int x;
+
+	/* The walker threads share w, and this thread is one of them. */
+	char **deferred = loaderror;
+	loaderror = 0;
+
+	pthread_mutex_init(&w.lock, 0);
+	pthread_cond_init(&w.wake, 0);
+	w.pending = 0;
+	w.pushes = 0;
+	w.threadcount = threadcount;
+	w.rootfd = rootfd;
+	w.root = root;
+	w.verbosepath = verbosepath;
+	w.hashes = hashqueue_new(threadcount > 1 ? threadcount : 0, rootfd);
+
+	w.deques = malloc(sizeof(struct walkdeque) * threadcount);
+	threads = malloc(sizeof(struct walkerthread) * threadcount);
+	if (!w.deques || !threads)
+		fatalerror("out of memory!");
+
+	for (x = 0; x < threadcount; ++x)
+	{
+		pthread_mutex_init(&w.deques[x].lock, 0);
+		w.deques[x].tasks = 0;
+		w.deques[x].allocated = 0;
+		w.deques[x].head = 0;
+		w.deques[x].tail = 0;
+
+		threads[x].walker = &w;
+		threads[x].id = x;
+		threads[x].reused = 0;
+		threads[x].cached = 0;
+		threads[x].rehashed = 0;
+		threads[x].reader = dirreader_new(DIRREADER_BUFFER_SIZE);
+		threads[x].paths = patharena_new(PATHARENA_BLOCK_SIZE);
+		if (!threads[x].reader || !threads[x].paths)
+			fatalerror("out of memory!");
+	}
+
+	struct walktask *top = walktask_new(0);
+	walker_push(&w, 0, top);
+
+	for (x = 1; x < threadcount; ++x)
+		if (pthread_create(&threads[x].thread, 0, walker_thread, &threads[x]) != 0)
+			fatalerror("could not create directory walking thread");
+
+	walker_thread(&threads[0]);
+
+	for (x = 1; x < threadcount; ++x)
+		pthread_join(threads[x].thread, 0);
+
+	hashqueue_finish(w.hashes);
+
+	loaderror = deferred;
+
+	const int foundone = walktask_collect(top, collection);
+
+	for (x = 0; x < threadcount; ++x)
+	{
+		pthread_mutex_lock(&countlock);
+		reusedcount += threads[x].reused;
+		cachedcount += threads[x].cached;
+		rehashedcount += threads[x].rehashed;
+		pthread_mutex_unlock(&countlock);
+
+		pthread_mutex_destroy(&w.deques[x].lock);
+		free(w.deques[x].tasks);
+		dirreader_free(threads[x].reader);
+
+		/* Paths found by each thread now belong to the collection, unless it made its own copies. */
+		if (!collection->spill)
+			patharena_adopt(collection->paths, threads[x].paths);
+
+		patharena_free(threads[x].paths);
+	}
+
+	free(w.deques);
+	free(threads);
+
+	pthread_cond_destroy(&w.wake);
+	pthread_mutex_destroy(&w.lock);
+
+	return foundone;
+}
+
+struct directoryentrycollection *directoryentrycollection_getfromfilesystem(char *path, char *root)
+{
+	struct directoryentrycollection *collection = directoryentrycollection_new();
+	if (!collection)
+		fatalerror("out of memory!");
+
+	directoryentrycollection_setbudget(collection, root);
+
+	int rootfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (rootfd < 0)
+		fatalerror("could not open %s!", path);
+
+	const int foundone = directoryentry_addfromfilesystem(collection, rootfd, root, path, jobcount);
+
+	/* The walk hands entries over in order, so there is nothing left to sort. */
+	collection->sorted = 1;
+	collection->hasmetadata = 1;
+
+	close(rootfd);
+
+	if (root && !foundone)
+		fatalerror("subdirectory %s not found in %s", root, path);
+
+	return collection;
+}
+
+void walkstack_push(struct walkstack *stack, struct walktask *task)
+{
+	if (stack->count == stack->allocated)
+	{
+		size_t allocated = stack->allocated ? stack->allocated * 2 : 16;
+
+		struct walkframe *newframes = realloc(stack->frames, sizeof(struct walkframe) * allocated);
+		if (!newframes)
+			fatalerror("out of memory!");
+
+		stack->frames = newframes;
+		stack->allocated = allocated;
+	}
+
+	stack->frames[stack->count].task = task;
+	stack->frames[stack->count].entry = 0;
+	stack->frames[stack->count].subtask = 0;
+	++stack->count;
+}
+
+/*
+ * List the directory for task in window, giving it an arena of its own so
+ * its paths can be released with it, and put its subdirectories in order.
+ */
+void walkstream_list(struct walkerthread *t, struct walktask *task, size_t window)
+{
+	task->paths = patharena_new(STREAM_PATHARENA_BLOCK_SIZE);
+	if (!task->paths)
+		fatalerror("out of memory!");
+
+	t->paths = task->paths;
+
+	walker_run(t, task);
+
+	task->window = window;
+
+	qsort(task->subtasks, task->subtaskcount, sizeof(struct walktask *), walktask_comparebypath);
+}
+
+/* Drop the directories at the top of the listing stack that have no subdirectories left to list. */
+void walkstream_popfinished(struct walkstack *listing)
+{
+	while (listing->count > 0)
+	{
+		struct walkframe *f = &listing->frames[listing->count - 1];
+
+		if (f->subtask < f->task->subtaskcount)
+			break;
+
+		--listing->count;
+	}
+}
+
+/*
+ * Print what the walk has in order up to the first directory not hashed
+ * yet, that is, one listed in a window that has not finished, freeing each
+ * directory once it and everything below it is printed. The header goes out
+ * with the first directory that has any entries, setting *foundone.
+ */
+void walkstream_print(struct walkstack *printing, size_t finished, int *foundone)
+{
+	while (printing->count > 0)
+	{
+		struct walkframe *f = &printing->frames[printing->count - 1];
+		struct walktask *task = f->task;
+		struct directoryentrycollection *entries = task->entries;
+
+		if (!*foundone && entries->length > 0)
+		{
+			printhashesheader(1);
+			*foundone = 1;
+		}
+
+		for (; f->entry < entries->length; ++f->entry)
+		{
+			struct directoryentry *entry = &entries->entries[f->entry];
+
+			if (f->subtask < task->subtaskcount && comparewithdirectory(entry->fullpath, 0, task->subtasks[f->subtask]->path.chars) > 0)
+				break;
+
+			if (entry->type == DT_UNKNOWN)
+				continue;
+
+			directoryentry_print(entry, ISFLAG(flags, F_V3OUTPUT), output);
+			output_check();
+		}
+
+		if (f->subtask < task->subtaskcount)
+		{
+			struct walktask *subtask = task->subtasks[f->subtask];
+
+			if (subtask->window >= finished)
+				return;
+
+			++f->subtask;
+
+			directoryentrycollection_sortby(subtask->entries, 0);
+			walkstack_push(printing, subtask);
+
+			continue;
+		}
+
+		walktask_free(task);
+		--printing->count;
+	}
+}
+
+/*
+ * Print the hashes of the directory at path as they are found, in sorted
+ * order, without holding the whole tree. Directories are listed in the order
+ * they are printed, in windows of up to STREAM_WINDOW_MAX_SIZE entries.
+ * Each window's files go on being hashed while the next window is listed,
+ * and are printed once the queue has drained them, so at most two windows
+ * and the directories above them are held at a time.
+ */
+void directoryentry_printfromfilesystem(char *path, char *root)
+{
+	struct walker w;
+	struct walkerthread t;
+	struct walkstack listing = { 0, 0, 0 };
+	struct walkstack printing = { 0, 0, 0 };
+	int hashing = 0;
+	int more = 1;
+	size_t window = 0;
+	size_t finished = 0;
+	size_t windowsize = STREAM_WINDOW_MIN_SIZE;
+	int foundone = 0;
+
+	int rootfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (rootfd < 0)
+		fatalerror("could not open %s!", path);
+
+	w.deques = 0;
+	w.threadcount = 1;
+	w.rootfd = rootfd;
+	w.root = root;
+	w.verbosepath = path;
+
+	t.walker = &w;
+	t.id = 0;
+	t.reused = 0;
+	t.cached = 0;
+	t.rehashed = 0;
+	t.reader = dirreader_new(DIRREADER_BUFFER_SIZE);
+	if (!t.reader)
+		fatalerror("out of memory!");
+
+	struct walktask *top = walktask_new(0);
+
+	w.hashes = hashqueue_new(jobcount > 1 ? jobcount : 0, rootfd);
+	walkstream_list(&t, top, window);
+	walkstack_push(&listing, top);
+	walkstream_popfinished(&listing);
+
+	while (1)
+	{
+		size_t listed = 0;
+
+		/* Listing goes down each subdirectory in turn, the same order printing takes. */
+		while (listing.count > 0 && listed < windowsize)
+		{
+			struct walkframe *f = &listing.frames[listing.count - 1];
+			struct walktask *subtask = f->task->subtasks[f->subtask++];
+
+			walkstream_list(&t, subtask, window);
+			walkstack_push(&listing, subtask);
+			walkstream_popfinished(&listing);
+
+			listed += subtask->entries->length;
+		}
+
+		if (hashing)
+		{
+			hashqueue_drain(w.hashes);
+
+			/* Entries can be put in order only once no hash job refers to them by index. */
+			if (finished++ == 0)
+			{
+				directoryentrycollection_sortby(top->entries, 0);
+				walkstack_push(&printing, top);
+			}
+
+			walkstream_print(&printing, finished, &foundone);
+
+			outbuffer_flush(output);
+			output_check();
+		}
+
+		if (!more)
+			break;
+
+		/* Whatever is queued from here on belongs to the next window, even if nothing is. */
+		hashqueue_nextwindow(w.hashes);
+		hashing = 1;
+		more = listing.count > 0;
+
+		if (more)
+		{
+			++window;
+			windowsize = MIN(windowsize * 2, STREAM_WINDOW_MAX_SIZE);
+		}
+	}
+
+	hashqueue_finish(w.hashes);
+
+	close(rootfd);
+	dirreader_free(t.reader);
+	free(listing.frames);
+	free(printing.frames);
+
+	pthread_mutex_lock(&countlock);
+	reusedcount += t.reused;
+	cachedcount += t.cached;
+	rehashedcount += t.rehashed;
+	pthread_mutex_unlock(&countlock);
+
+	if (root && !foundone)
+		fatalerror("subdirectory %s not found in %s", root, path);
+
+	if (!foundone)
+		printhashesheader(1);
+}
+
+/* Copy whatever metadata the archive records for ae into de. */
+void directoryentry_setmetadatafromarchive(struct directoryentry *de, struct archive_entry *ae)
+{
+	de->size = archive_entry_size_is_set(ae) ? archive_entry_size(ae) : 0;
+	de->mtime_ns = 0;
+	de->ctime_ns = 0;
+	de->inode = archive_entry_ino_is_set(ae) ? archive_entry_ino64(ae) : 0;
+	de->device = archive_entry_dev_is_set(ae) ? archive_entry_dev(ae) : 0;
+
+	if (archive_entry_mtime_is_set(ae))
+		de->mtime_ns = (int64_t)archive_entry_mtime(ae) * 1000000000 + archive_entry_mtime_nsec(ae);
+
+	if (archive_entry_ctime_is_set(ae))
+		de->ctime_ns = (int64_t)archive_entry_ctime(ae) * 1000000000 + archive_entry_ctime_nsec(ae);
+}
+
+void *archivepipeline_worker(void *arg)
+{
+	struct archivepipeline *p = arg;
+
+	pthread_mutex_lock(&p->lock);
+
+	while (1)
+	{
+		if (p->claimed == p->tail)
+		{
+			if (p->closed)
+				break;
+
+			pthread_cond_wait(&p->work, &p->lock);
+			continue;
+		}
+
+		struct archivejob *job = &p->jobs[p->claimed++ % ARCHIVE_PIPELINE_MAX_ENTRIES];
+
+		/* Directories and small files need nothing from a worker. */
+		if (job->done)
+			continue;
+
+		sha256 sha256_state;
+		sha256_init(&sha256_state);
+
+		while (job->first || !job->complete)
+		{
+			struct archivechunk *chunk = job->first;
+
+			if (!chunk)
+			{
+				pthread_cond_wait(&p->work, &p->lock);
+				continue;
+			}
+
+			job->first = chunk->next;
+			if (!job->first)
+				job->last = 0;
+
+			pthread_mutex_unlock(&p->lock);
+
+			sha256_append(&sha256_state, chunk->data, chunk->length);
+
+			pthread_mutex_lock(&p->lock);
+
+			chunk->next = p->chunks;
+			p->chunks = chunk;
+
+			pthread_cond_signal(&p->space);
+		}
+
+		sha256_finalize_bytes(&sha256_state, job->entry.hash);
+		job->done = 1;
+
+		pthread_cond_signal(&p->space);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+
+	return 0;
+}
+
+struct archivepipeline *archivepipeline_new(int workercount)
+{
+	struct archivepipeline *p = malloc(sizeof(struct archivepipeline));
+	if (!p)
+		fatalerror("out of memory!");
+
+	p->pool = malloc(sizeof(struct archivechunk) * ARCHIVE_CHUNK_COUNT);
+	p->workers = malloc(sizeof(pthread_t) * workercount);
+	if (!p->pool || !p->workers)
+		fatalerror("out of memory!");
+
+	p->chunks = 0;
+
+	int x;
+	for (x = 0; x < ARCHIVE_CHUNK_COUNT; ++x)
+	{
+		p->pool[x].next = p->chunks;
+		p->chunks = &p->pool[x];
+	}
+
+	pthread_mutex_init(&p->lock, 0);
+	pthread_cond_init(&p->work, 0);
+	pthread_cond_init(&p->space, 0);
+	p->head = 0;
+	p->claimed = 0;
+	p->tail = 0;
+	p->closed = 0;
+	p->workercount = workercount;
+
+	for (x = 0; x < workercount; ++x)
+		if (pthread_create(&p->workers[x], 0, archivepipeline_worker, p) != 0)
+			fatalerror("could not create hashing thread");
+
+	return p;
+}
+
+/* Move the finished entries at the front of the ring into collection, in archive order. */
+void archivepipeline_collect(struct archivepipeline *p, struct directoryentrycollection *collection)
+{
+	size_t end;
+
+	pthread_mutex_lock(&p->lock);
+	for (end = p->head; end < p->tail && p->jobs[end % ARCHIVE_PIPELINE_MAX_ENTRIES].done; ++end)
+		;
+	pthread_mutex_unlock(&p->lock);
+
+	for (; p->head < end; ++p->head)
+	{
+		struct archivejob *job = &p->jobs[p->head % ARCHIVE_PIPELINE_MAX_ENTRIES];
+
+		job->entry.fullpath = patharena_copy(collection->paths, job->path.chars, strlen(job->path.chars));
+		if (!job->entry.fullpath)
+			fatalerror("out of memory!");
+
+		directoryentrycollection_append(collection, &job->entry);
+
+		string_free(job->path);
+	}
+}
+
+/* Wait for the oldest entry in the ring to be hashed. */
+void archivepipeline_waitforhead(struct archivepipeline *p)
+{
+	pthread_mutex_lock(&p->lock);
+	while (!p->jobs[p->head % ARCHIVE_PIPELINE_MAX_ENTRIES].done)
+		pthread_cond_wait(&p->space, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Queue entry, whose path is taken over, collecting finished entries into
+ * collection while waiting for room. Unless done is set, because entry is a
+ * directory or was hashed on the spot, its data follows through
+ * archivepipeline_readdata.
+ */
+struct archivejob *archivepipeline_add(struct archivepipeline *p, struct directoryentrycollection *collection, struct directoryentry *entry, struct string path, int done)
+{
+	archivepipeline_collect(p, collection);
+
+	while (p->tail - p->head == ARCHIVE_PIPELINE_MAX_ENTRIES)
+	{
+		archivepipeline_waitforhead(p);
+		archivepipeline_collect(p, collection);
+	}
+
+	struct archivejob *job = &p->jobs[p->tail % ARCHIVE_PIPELINE_MAX_ENTRIES];
+	job->entry = *entry;
+	job->path = path;
+	job->first = 0;
+	job->last = 0;
+	job->complete = done;
+	job->done = done;
+
+	pthread_mutex_lock(&p->lock);
+	++p->tail;
+	if (!done)
+		pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	return job;
+}
+
+/* Copy the data of the current entry of a into chunks for the workers hashing job. */
+void archivepipeline_readdata(struct archivepipeline *p, struct archivejob *job, struct archive *a)
+{
+	while (1)
+	{
+		pthread_mutex_lock(&p->lock);
+
+		while (!p->chunks)
+			pthread_cond_wait(&p->space, &p->lock);
+
+		struct archivechunk *chunk = p->chunks;
+		p->chunks = chunk->next;
+
+		pthread_mutex_unlock(&p->lock);
+
+		ssize_t read = archive_read_data(a, chunk->data, ARCHIVE_CHUNK_SIZE);
+
+		pthread_mutex_lock(&p->lock);
+
+		if (read > 0)
+		{
+			chunk->length = read;
+			chunk->next = 0;
+
+			if (job->last)
+				job->last->next = chunk;
+			else
+				job->first = chunk;
+
+			job->last = chunk;
+		}
+		else
+		{
+			chunk->next = p->chunks;
+			p->chunks = chunk;
+
+			job->complete = 1;
+		}
+
+		pthread_cond_broadcast(&p->work);
+		pthread_mutex_unlock(&p->lock);
+
+		if (read <= 0)
+			break;
+	}
+}
+
+/* Wait for every entry, collect them into collection and stop the workers. */
+void archivepipeline_finish(struct archivepipeline *p, struct directoryentrycollection *collection)
+{
+	archivepipeline_collect(p, collection);
+
+	while (p->head < p->tail)
+	{
+		archivepipeline_waitforhead(p);
+		archivepipeline_collect(p, collection);
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->closed = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	int x;
+	for (x = 0; x < p->workercount; ++x)
+		pthread_join(p->workers[x], 0);
+
+	pthread_cond_destroy(&p->space);
+	pthread_cond_destroy(&p->work);
+	pthread_mutex_destroy(&p->lock);
+
+	free(p->workers);
+	free(p->pool);
+	free(p);
+}
+
+struct directoryentrycollection *directoryentrycollection_getfromarchive(struct BUFFEREDFILE *bfile, char *path, char *root)
+{
+	struct directoryentrycollection *collection = directoryentrycollection_new();
+	directoryentrycollection_setbudget(collection, root);
+
+	struct archive *a;
+	struct archive_entry *entry;
+
+	a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+
+	struct libarchivedata ldata;
+	ldata.bstream = bfile;
+
+	int foundone = 0;
+	int archiveresult = 0;
+
+	if (archive_read_open(a, &ldata, openarchive, readarchive, closearchive) != ARCHIVE_OK)
+		fatalerror("error reading archive '%s'", path);
+
+	while ((archiveresult = archive_read_next_header(a, &entry)) == ARCHIVE_OK)
+	{
+		mode_t filetype = archive_entry_filetype(entry);
+
+		if (filetype == AE_IFREG)
+		{
+			struct string s = string_fromchars(archive_entry_pathname(entry));
+
+			char *rpath = s.chars;
+			if (root != 0)
+				rpath = relativepath(s.chars, root);
+
+			if (rpath != 0)
+			{
+				foundone = 1;
+
+				if (ISFLAG(flags, F_VERBOSE))
+					fprintf(stderr, "[%s] %s\n", path, s.chars);
+
+				sha256 sha256_state;
+				sha256_init(&sha256_state);
+
+				uint8_t buf[8192];
+				ssize_t read = archive_read_data(a, buf, 8192);
+				while (read > 0)
+				{
+					sha256_append(&sha256_state, buf, read);
+
+					read = archive_read_data(a, buf, 8192);
+				}
+
+				struct directoryentry direntry;
+				direntry.fullpath = patharena_copy(collection->paths, s.chars, strlen(s.chars));
+				if (!direntry.fullpath)
+					fatalerror("out of memory!");
+
+				direntry.nameoffset = rpath - s.chars;
+				direntry.type = DT_REG;
+				directoryentry_setmetadatafromarchive(&direntry, entry);
+
+				sha256_finalize_bytes(&sha256_state, direntry.hash);
+
+				directoryentrycollection_append(collection, &direntry);
+			}
+			else
+			{
+				archive_read_data_skip(a);
+			}
+
+			string_free(s);
+		}
+		else if (filetype == AE_IFDIR)
+		{
+			struct string s = string_fromchars(archive_entry_pathname(entry));
+			string_removetrailingcharacter(&s, '/');
+
+			char *rpath = s.chars;
+			if (root != 0)
+				rpath = relativepath(s.chars, root);
+
+			if (rpath != 0) {
+				foundone = 1;
+
+				if (ISFLAG(flags, F_VERBOSE))
+					fprintf(stderr, "[%s] %s\n", path, s.chars);
+
+				struct directoryentry direntry;
+				direntry.fullpath = patharena_copy(collection->paths, s.chars, strlen(s.chars));
+				if (!direntry.fullpath)
+					fatalerror("out of memory!");
+
+				direntry.nameoffset = rpath - s.chars;
+				direntry.type = DT_DIR;
+				directoryentry_setmetadatafromarchive(&direntry, entry);
+
+				directoryentrycollection_append(collection, &direntry);
+			}
+			else {
+				archive_read_data_skip(a);
+			}
+
+			string_free(s);
+		}
+		else {
+			archive_read_data_skip(a);
+		}
+	}
+
+	archive_read_close(a);
+	archive_read_free(a);
+
+	if (archiveresult != ARCHIVE_EOF)
+		fatalerror("error reading archive '%s'", path);
+
+	if (root && !foundone)
+		fatalerror("directory %s not found in %s", root, path);
+
+	return collection;
+}
+
+/*
+ * Read the entries of the archive in bfile, hashing the data of each file
+ * that is not small on worker threads while the archive goes on being
+ * decompressed and read. Entries still join the collection in archive order.
+ */
+struct directoryentrycollection *directoryentrycollection_getfromarchiveinparallel(struct BUFFEREDFILE *bfile, char *path, char *root)
+{
+	struct directoryentrycollection *collection = directoryentrycollection_new();
+	directoryentrycollection_setbudget(collection, root);
+
+	struct archive *a;
+	struct archive_entry *entry;
+
+	a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+
+	struct libarchivedata ldata;
+	ldata.bstream = bfile;
+
+	int foundone = 0;
+	int archiveresult = 0;
+
+	if (archive_read_open(a, &ldata, openarchive, readarchive, closearchive) != ARCHIVE_OK)
+		fatalerror("error reading archive '%s'", path);
+
+	/* The hashing threads share the pipeline until it is finished. */
+	char **deferred = loaderror;
+	loaderror = 0;
+
+	struct archivepipeline *pipeline = archivepipeline_new(jobcount);
+
+	while ((archiveresult = archive_read_next_header(a, &entry)) == ARCHIVE_OK)
+	{
+		mode_t filetype = archive_entry_filetype(entry);
+
+		if (filetype == AE_IFREG)
+		{
+			struct string s = string_fromchars(archive_entry_pathname(entry));
+
+			char *rpath = s.chars;
+			if (root != 0)
+				rpath = relativepath(s.chars, root);
+
+			if (rpath != 0)
+			{
+				foundone = 1;
+
+				if (ISFLAG(flags, F_VERBOSE))
+					fprintf(stderr, "[%s] %s\n", path, s.chars);
+
+				struct directoryentry direntry;
+				direntry.nameoffset = rpath - s.chars;
+				direntry.type = DT_REG;
+				directoryentry_setmetadatafromarchive(&direntry, entry);
+
+				/* Handing a small file to a worker would cost more than hashing it. */
+				int small = archive_entry_size_is_set(entry) && direntry.size <= SMALLFILE_MAX_SIZE;
+
+				if (!small)
+				{
+					struct archivejob *job = archivepipeline_add(pipeline, collection, &direntry, s, 0);
+					archivepipeline_readdata(pipeline, job, a);
+					continue;
+				}
+
+				sha256 sha256_state;
+				sha256_init(&sha256_state);
+
+				uint8_t buf[8192];
+				ssize_t read = archive_read_data(a, buf, 8192);
+				while (read > 0)
+				{
+					sha256_append(&sha256_state, buf, read);
+
+					read = archive_read_data(a, buf, 8192);
+				}
+
+				sha256_finalize_bytes(&sha256_state, direntry.hash);
+
+				archivepipeline_add(pipeline, collection, &direntry, s, 1);
+				continue;
+			}
+			else
+			{
+				archive_read_data_skip(a);
+			}
+
+			string_free(s);
+		}
+		else if (filetype == AE_IFDIR)
+		{
+			struct string s = string_fromchars(archive_entry_pathname(entry));
+			string_removetrailingcharacter(&s, '/');
+
+			char *rpath = s.chars;
+			if (root != 0)
+				rpath = relativepath(s.chars, root);
+
+			if (rpath != 0) {
+				foundone = 1;
+
+				if (ISFLAG(flags, F_VERBOSE))
+					fprintf(stderr, "[%s] %s\n", path, s.chars);
+
+				struct directoryentry direntry;
+				direntry.nameoffset = rpath - s.chars;
+				direntry.type = DT_DIR;
+				directoryentry_setmetadatafromarchive(&direntry, entry);
+
+				/* Directories wait their turn behind files still being hashed. */
+				archivepipeline_add(pipeline, collection, &direntry, s, 1);
+				continue;
+			}
+			else {
+				archive_read_data_skip(a);
+			}
+
+			string_free(s);
+		}
+		else {
+			archive_read_data_skip(a);
+		}
+	}
+
+	archivepipeline_finish(pipeline, collection);
+
+	loaderror = deferred;
+
+	archive_read_close(a);
+	archive_read_free(a);
+
+	if (archiveresult != ARCHIVE_EOF)
+		fatalerror("error reading archive '%s'", path);
+
+	if (root && !foundone)
+		fatalerror("directory %s not found in %s", root, path);
+
+	return collection;
+}
+
+/*
+ * A byte range of a mapped hashfile, parsed by one thread. The range starts
+ * at the beginning of a line and ends just after a newline (or at the end of
+ * the file), so each line belongs to exactly one range.
+ */
+struct hashfilechunk
+{
+	const char *data;
+	size_t start;
+	size_t end;
+	char *root;
+	int version;
+	struct directoryentrycollection *entries;
+	size_t lines;
+	size_t errorline;
+	char *errortext;
+	pthread_t thread;
+};
+
+void *hashfilechunk_parse(void *arg)
+{
+	struct hashfilechunk *chunk = arg;
+	struct directoryentry entry;
+
+	size_t size = 256;
+	char *line = malloc(size);
+	if (!line)
+		fatalerror("out of memory!");
+
+	size_t pos = chunk->start;
+	while (pos < chunk->end)
+	{
+		const char *newline = memchr(chunk->data + pos, '\n', chunk->end - pos);
+		if (newline == 0)
+			break;
+
+		/* The mapping is read-only, so each line is copied out to be terminated. */
+		size_t length = newline - (chunk->data + pos);
+		if (length + 1 > size)
+		{
+			size = length + 1;
+			free(line);
+			line = malloc(size);
+			if (!line)
+				fatalerror("out of memory!");
+		}
+
+		memcpy(line, chunk->data + pos, length);
+		line[length] = '\0';
+		pos += length + 1;
+
+		++chunk->lines;
+
+		const int result = directoryentry_parseline(line, &entry, chunk->root, chunk->version, chunk->entries->paths);
+
+		if (result == 1) {
+			directoryentrycollection_add(chunk->entries, &entry);
+		}
+		else if (result == -1) {
+			chunk->errorline = chunk->lines;
+			chunk->errortext = line;
+			return 0;
+		}
+	}
+
+	free(line);
+
+	return 0;
+}
+
+/*
+ * Parse a regular hashfile by splitting everything after its header into
+ * newline-aligned ranges and handing each range to a thread. Returns 0 if the
+ * file cannot be mapped, in which case it should be read sequentially.
+ */
+struct directoryentrycollection *directoryentrycollection_getfromhashfileinparallel(int fd, size_t filesize, size_t header, char *path, char *root, int version, int threadcount)
+{
+	char *map = mmap(0, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	madvise(map, filesize, MADV_SEQUENTIAL);
+
+	struct hashfilechunk *chunks = malloc(sizeof(struct hashfilechunk) * threadcount);
+	if (!chunks)
+		fatalerror("out of memory!");
+
+	const size_t body = filesize - header;
+
+	int x;
+	for (x = 0; x < threadcount; ++x)
+	{
+		size_t start = header;
+		if (x > 0)
+		{
+			/* Begin after the first newline at or past the even split point. */
+			start = MAX(header + body / threadcount * x - 1, chunks[x - 1].start);
+			const char *newline = memchr(map + start, '\n', filesize - start);
+			start = newline ? (size_t)(newline + 1 - map) : filesize;
+
+			chunks[x - 1].end = start;
+		}
+
+		chunks[x].data = map;
+		chunks[x].start = start;
+		chunks[x].end = filesize;
+		chunks[x].root = root;
+		chunks[x].version = version;
+		chunks[x].entries = directoryentrycollection_new();
+		chunks[x].lines = 0;
+		chunks[x].errorline = 0;
+		chunks[x].errortext = 0;
+	}
+
+	/* The parsing threads share chunks, and this thread parses the first. */
+	char **deferred = loaderror;
+	loaderror = 0;
+
+	for (x = 1; x < threadcount; ++x)
+		if (pthread_create(&chunks[x].thread, 0, hashfilechunk_parse, &chunks[x]) != 0)
+			fatalerror("could not create hashfile parsing thread");
+
+	hashfilechunk_parse(&chunks[0]);
+
+	for (x = 1; x < threadcount; ++x)
+		pthread_join(chunks[x].thread, 0);
+
+	loaderror = deferred;
+
+	/* Report the first error in file order, numbering lines across ranges. */
+	size_t lineno = 0;
+	size_t total = 0;
+	for (x = 0; x < threadcount; ++x)
+	{
+		if (chunks[x].errorline)
+			fatalerror("hashfile contains errors in line %zu:\n\"%s\"", lineno + chunks[x].errorline, chunks[x].errortext);
+
+		lineno += chunks[x].lines;
+		total += chunks[x].entries->length;
+	}
 
-				if (ISFLAG(flags, F_VERBOSE))
-					fprintf(stderr, "[%s] %s\n", path, s.chars);
+	/* The first range's array grows to hold the others, which are appended in order. */
+	struct directoryentrycollection *collection = chunks[0].entries;
 
-				sha256 sha256_state;
-				sha256_init(&sha256_state);
+	struct directoryentry *entries = realloc(collection->entries, sizeof(struct directoryentry) * MAX(total, 1));
+	if (!entries)
+		fatalerror("out of memory!");
 
-				uint8_t buf[8192];
-				ssize_t read = archive_read_data(a, buf, 8192);
-				while (read > 0)
-				{
-					sha256_append(&sha256_state, buf, read);
+	collection->entries = entries;
+	collection->allocated = MAX(total, 1);
 
-					read = archive_read_data(a, buf, 8192);
-				}
+	for (x = 1; x < threadcount; ++x)
+	{
+		memcpy(collection->entries + collection->length, chunks[x].entries->entries, sizeof(struct directoryentry) * chunks[x].entries->length);
+		collection->length += chunks[x].entries->length;
 
-				struct directoryentry direntry;
-				direntry.name = string_fromchars(rpath);
-				direntry.fullpath = string_fromchars(s.chars);
-				direntry.type = DT_REG;
+		/* The entries and their paths now belong to the combined collection. */
+		patharena_adopt(collection->paths, chunks[x].entries->paths);
+		directoryentrycollection_free(chunks[x].entries);
+	}
 
-				sha256_finalize_bytes(&sha256_state, direntry.hash);
+	if (ISFLAG(flags, F_VERBOSE))
+	{
+		size_t e;
+		for (e = 0; e < collection->length; ++e)
+			fprintf(stderr, "[%s] %s\n", path, collection->entries[e].fullpath);
+	}
 
-				directoryentrycollection_add(collection, &direntry);
-			}
-			else
-			{
-				archive_read_data_skip(a);
-			}
+	free(chunks);
+	munmap(map, filesize);
 
-			string_free(s);
-		}
-		else if (filetype == AE_IFDIR)
-		{
-			struct string s = string_fromchars(archive_entry_pathname(entry));
-			string_removetrailingcharacter(&s, '/');
+	return collection;
+}
 
-			char *rpath = s.chars;
-			if (root != 0)
-				rpath = relativepath(s.chars, root);
+struct directoryentrycollection *directoryentrycollection_getfromhashfile(struct BUFFEREDFILE *bfile, char *path, char *root)
+{
+	struct hashfilereader *reader = hashfilereader_new(bfile, path, root, HASHFILE_BUFFER_SIZE);
+	if (!reader)
+	{
+		/* Snapshots in regular files are mapped before this is reached. */
+		uint8_t magic[8];
+		if (bufferedfile_getbytes(magic, 8, bfile) == 8 && memcmp(magic, SNAPSHOT_MAGIC, 8) == 0)
+			fatalerror("binary snapshot '%s' cannot be read from a pipe", path);
 
-			if (rpath != 0) {
-				foundone = 1;
+		bufferedfile_ungetbytes(bfile);
+		return 0;
+	}
 
-				if (ISFLAG(flags, F_VERBOSE))
-					fprintf(stderr, "[%s] %s\n", path, s.chars);
+	struct directoryentrycollection *collection = 0;
 
-				struct directoryentry direntry;
-				direntry.name = string_fromchars(rpath);
-				direntry.fullpath = string_fromchars(s.chars);
-				direntry.type = DT_DIR;
+	/* Large regular files are split between threads; pipes are read sequentially. */
+	struct stat info;
+	if (jobcount > 1 && maxmemory == 0 && bfile->stream != stdin && fstat(fileno(bfile->stream), &info) == 0 &&
+		S_ISREG(info.st_mode) && info.st_size >= HASHFILE_PARALLEL_MIN_SIZE)
+	{
+		collection = directoryentrycollection_getfromhashfileinparallel(fileno(bfile->stream), info.st_size, reader->headersize, path, root, reader->version, jobcount);
+		if (collection && root && collection->length == 0)
+			fatalerror("directory %s not found in %s", root, path);
+	}
 
-				directoryentrycollection_add(collection, &direntry);
-			}
-			else {
-				archive_read_data_skip(a);
-			}
+	if (!collection)
+	{
+		struct directoryentry entry;
 
-			string_free(s);
-		}
-		else {
-			archive_read_data_skip(a);
-		}
+		collection = directoryentrycollection_new();
+		directoryentrycollection_setbudget(collection, root);
+
+		while (hashfilereader_next(reader, &entry, collection->paths))
+			directoryentrycollection_append(collection, &entry);
 	}
 
-	archive_read_close(a);
-	archive_read_free(a);
+	collection->hasmetadata = reader->version >= 3;
 
-	if (archiveresult != ARCHIVE_EOF)
-		fatalerror("error reading archive '%s'", path);
+	/* Trust the sorted flag only as far as the entries bear it out. */
+	if (reader->sorted)
+	{
+		collection->sorted = 1;
 
-	if (root && !foundone)
-		fatalerror("directory %s not found in %s", root, path);
+		size_t e;
+		for (e = 1; e < collection->length && collection->sorted; ++e)
+			if (strcmp(collection->entries[e - 1].fullpath, collection->entries[e].fullpath) > 0)
+				collection->sorted = 0;
+	}
+
+	hashfilereader_free(reader);
 
 	return collection;
 }
 
-struct directoryentrycollection *directoryentrycollection_getfromhashfile(struct BUFFEREDFILE *bfile, char *path, char *root)
+/*
+ * Load the binary snapshot at path by mapping it, with entries pointing
+ * straight into the mapped path table. Returns 0 if path is not a snapshot.
+ */
+struct directoryentrycollection *directoryentrycollection_getfromsnapshot(char *path, char *root)
 {
-	struct directoryentry entry;
+	struct snapshotheader header;
+	struct stat st;
 
-	uint8_t buf[10];
-	if (bufferedfile_getbytes(buf, 9, bfile) == 9)
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (readfully(fd, (unsigned char*)&header, sizeof(header)) != sizeof(header) || memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0)
 	{
-		buf[9] = '\0';
-		if (strcmp((char*)buf, "DIRHASH2\n") != 0) {
-			bufferedfile_ungetbytes(bfile);
-			return 0;
-		}
-		else {
-			struct directoryentrycollection *collection = directoryentrycollection_new();
+		close(fd);
+		return 0;
+	}
 
-			size_t lineno = 1;
-			struct string line = string_fromchars("");
+	if (header.version != SNAPSHOT_VERSION)
+		fatalerror("unsupported snapshot version in '%s'", path);
 
-			char c[2];
-			c[1] = 0;
+	if (fstat(fd, &st) != 0)
+		fatalerror("unable to read or open '%s'", path);
 
-			int result = 0;
-			int foundone = 0;
+	uint64_t size = st.st_size;
+	uint64_t body = size - sizeof(header);
 
-			while (bufferedfile_getbytes(c, 1, bfile) == 1)
-			{
-				switch (c[0])
-				{
-					case '\n':
-						result = directoryentry_getfromstring(&line, &entry, root);
+	if (header.count > body / sizeof(struct snapshotrecord) || header.stringsize != body - header.count * sizeof(struct snapshotrecord))
+		fatalerror("snapshot '%s' is truncated or corrupt", path);
 
-						if (result == 1) {
-							foundone = 1;
+	unsigned char *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		fatalerror("could not map snapshot '%s'", path);
 
-							if (ISFLAG(flags, F_VERBOSE))
-								fprintf(stderr, "[%s] %s\n", path, entry.fullpath.chars);
+	close(fd);
 
-							directoryentrycollection_add(collection, &entry);
-						}
-						else if (result == -1) {
-							fatalerror("hashfile contains errors in line %d:\n\"%s\"", lineno, line.chars);
-						}
+	madvise(map, size, MADV_SEQUENTIAL);
 
-						++lineno;
-						line.chars[0] = '\0';
-						break;
+	unsigned char checksum[SHA256_BYTES_SIZE];
+	sha256 state;
+	sha256_init(&state);
+	sha256_append(&state, map + sizeof(header), body);
+	sha256_finalize_bytes(&state, checksum);
 
-					default:
-						string_append(&line, c);
-						break;
-				}
-			}
+	if (memcmp(checksum, header.checksum, SHA256_BYTES_SIZE) != 0)
+		fatalerror("snapshot '%s' fails its checksum", path);
 
-			string_free(line);
+	const struct snapshotrecord *records = (const struct snapshotrecord *)(map + sizeof(header));
+	char *strings = (char *)(records + header.count);
 
-			if (root && !foundone)
-				fatalerror("directory %s not found in %s", root, path);
+	if (header.stringsize > 0 && strings[header.stringsize - 1] != '\0')
+		fatalerror("snapshot '%s' is truncated or corrupt", path);
 
-			return collection;
-		}
+	struct directoryentrycollection *collection = malloc(sizeof(struct directoryentrycollection));
+	if (!collection)
+		fatalerror("out of memory!");
+
+	collection->entries = malloc(sizeof(struct directoryentry) * MAX(header.count, 1));
+	if (!collection->entries)
+		fatalerror("out of memory!");
+
+	collection->allocated = MAX(header.count, 1);
+	collection->length = 0;
+	collection->sorted = (header.flags & SNAPSHOT_SORTED) != 0;
+	collection->map = map;
+	collection->mapsize = size;
+	collection->paths = 0;
+	collection->spill = 0;
+	collection->prefixes = 0;
+	collection->sortedbyname = 0;
+	collection->hasmetadata = 1;
+
+	uint64_t r;
+	for (r = 0; r < header.count; ++r)
+	{
+		const struct snapshotrecord *record = &records[r];
+
+		if (record->pathoffset >= header.stringsize || (record->type != DT_REG && record->type != DT_DIR))
+			fatalerror("snapshot '%s' is truncated or corrupt", path);
+
+		char *fullpath = strings + record->pathoffset;
+
+		char *rpath = fullpath;
+		if (root != 0)
+			rpath = relativepath(fullpath, root);
+
+		if (!rpath)
+			continue;
+
+		if (ISFLAG(flags, F_VERBOSE))
+			fprintf(stderr, "[%s] %s\n", path, fullpath);
+
+		struct directoryentry *de = &collection->entries[collection->length++];
+		de->fullpath = fullpath;
+		de->nameoffset = rpath - fullpath;
+		de->type = record->type;
+		memcpy(de->hash, record->hash, SHA256_BYTES_SIZE);
+		de->size = record->size;
+		de->mtime_ns = record->mtime_ns;
+		de->ctime_ns = record->ctime_ns;
+		de->inode = record->inode;
+		de->device = record->device;
 	}
 
-	bufferedfile_ungetbytes(bfile);
-	return 0;
+	if (root && collection->length == 0)
+		fatalerror("directory %s not found in %s", root, path);
+
+	return collection;
 }
 
 int use_stdin(const char *path) {
@@ -1118,6 +5025,9 @@ struct directoryentrycollection *directoryentrycollection_getfromfile(char *path
 	struct BUFFEREDFILE *bfile;
 	struct directoryentrycollection *collection = 0;
 
+	if (!use_stdin(path) && (collection = directoryentrycollection_getfromsnapshot(path, root)) != 0)
+		return collection;
+
 	if (!use_stdin(path))
 		f = fopen(path, "rb");
 	else
@@ -1130,7 +5040,10 @@ struct directoryentrycollection *directoryentrycollection_getfromfile(char *path
 		{
 			collection = directoryentrycollection_getfromhashfile(bfile, path, root);
 
-			if (!collection)
+			/* Archive data is hashed on worker threads only with more than one job. */
+			if (!collection && jobcount > 1)
+				collection = directoryentrycollection_getfromarchiveinparallel(bfile, path, root);
+			else if (!collection)
 				collection = directoryentrycollection_getfromarchive(bfile, path, root);
 
 			bufferedfile_destroy(bfile);
@@ -1143,6 +5056,89 @@ struct directoryentrycollection *directoryentrycollection_getfromfile(char *path
 	return collection;
 }
 
+/*
+ * Return when the hashfile or snapshot at path was written, taken from the
+ * modification time of the file. For pipes, which have none to go by, the
+ * current time is used instead, which can only make fewer digests reusable.
+ */
+int64_t snapshottime(char *path)
+{
+	struct stat info;
+	struct timespec now;
+
+	if ((use_stdin(path) ? fstat(STDIN_FILENO, &info) : stat(path, &info)) == 0 && S_ISREG(info.st_mode))
+		return (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Nonzero if path is a text hashfile whose header says it is sorted. */
+int hashfile_issorted(char *path)
+{
+	int sorted = 0;
+
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return 0;
+
+	struct BUFFEREDFILE *bfile = bufferedfile_init(f, ARCHIVE_BUFFER_SIZE);
+
+	struct hashfilereader *reader = hashfilereader_new(bfile, path, 0, ARCHIVE_BUFFER_SIZE);
+	if (reader)
+	{
+		sorted = reader->sorted;
+		hashfilereader_free(reader);
+	}
+
+	bufferedfile_destroy(bfile);
+	fclose(f);
+
+	return sorted;
+}
+
+/*
+ * Compare two sorted hashfiles by reading both a line at a time, so that
+ * neither has to fit in memory.
+ */
+void hashfile_comparesorted(char *frompath, char *froot, char *topath, char *troot)
+{
+	struct entrycursor from;
+	struct entrycursor to;
+
+	FILE *f1 = fopen(frompath, "rb");
+	if (!f1)
+		fatalerror("unable to read or open '%s'", frompath);
+
+	FILE *f2 = fopen(topath, "rb");
+	if (!f2)
+		fatalerror("unable to read or open '%s'", topath);
+
+	struct BUFFEREDFILE *b1 = bufferedfile_init(f1, ARCHIVE_BUFFER_SIZE);
+	struct BUFFEREDFILE *b2 = bufferedfile_init(f2, ARCHIVE_BUFFER_SIZE);
+
+	struct hashfilereader *r1 = hashfilereader_new(b1, frompath, froot, HASHFILE_BUFFER_SIZE);
+	struct hashfilereader *r2 = hashfilereader_new(b2, topath, troot, HASHFILE_BUFFER_SIZE);
+	if (!r1 || !r2)
+		fatalerror("unable to read hashes from '%s'", !r1 ? frompath : topath);
+
+	entrycursor_initreader(&from, r1, 0, 0);
+	entrycursor_initreader(&to, r2, 0, 0);
+
+	entrycursor_compare(&from, &to, froot, troot);
+
+	entrycursor_free(&from);
+	entrycursor_free(&to);
+
+	hashfilereader_free(r1);
+	hashfilereader_free(r2);
+	bufferedfile_destroy(b1);
+	bufferedfile_destroy(b2);
+	fclose(f1);
+	fclose(f2);
+}
+
 void print_usage() {
 	printf("Usage: dirchanges [options...] FROM [options...] [TO] [options...]\n");
 }
@@ -1161,6 +5157,25 @@ void help_text()
 
 	printf(" -H --hash              read files in FROM and print a list of hashes to\n");
 	printf("                        standard output for later use\n");
+	printf("    --format=FORMAT     write hashes as DIRHASH2 text (the default), as\n");
+	printf("                        DIRHASH3 text with file metadata (v3), or as a\n");
+	printf("                        binary snapshot (bin)\n");
+	printf("    --sorted            write hashes sorted by path, letting two sorted\n");
+	printf("                        hashfiles be compared without loading them; text\n");
+	printf("                        output is written as DIRHASH3\n");
+	printf(" -j --jobs=N            hash files, parse hashfiles and sort using N threads\n");
+	printf("    --mmap-min=SIZE     hash files of at least SIZE bytes (K, M, or G suffix\n");
+	printf("                        allowed) from memory mappings; 0 disables mappings\n");
+	printf("    --max-memory=SIZE   when comparing, keep about SIZE bytes of entries in\n");
+	printf("                        memory and spill the rest to sorted temporary files\n");
+	printf("    --reuse=HASHFILE    take digests from HASHFILE for files whose size,\n");
+	printf("                        mtime and ctime have not changed since it was made;\n");
+	printf("                        HASHFILE must be written with --format=v3 or bin\n");
+	printf("    --cache=FILE        look up and store file digests in the cache FILE,\n");
+	printf("                        keyed by device, inode, size, mtime and ctime\n");
+	printf("    --cache-max=SIZE    keep the cache file below SIZE bytes (default 64M)\n");
+	printf("    --compact-cache=FILE\n");
+	printf("                        shrink the cache FILE to fit its contents and exit\n");
 	printf(" -w --within=DIRECTORY  include only files appearing below DIRECTORY; this\n");
 	printf("                        option applies to the preceding argument (FROM or TO)\n");
 	printf("                        and, if used, must appear directly after it\n");
@@ -1171,10 +5186,119 @@ void help_text()
 	printf(" -h --help              display this help message\n\n");
 }
 
+/* Parse a number of jobs from 1 to MAX_JOB_COUNT. */
+int parsejobcount(const char *text, int *count)
+{
+	char *end;
+
+	if (*text < '0' || *text > '9')
+		return 0;
+
+	errno = 0;
+	long value = strtol(text, &end, 10);
+
+	if (errno != 0 || *end != '\0' || value < 1 || value > MAX_JOB_COUNT)
+		return 0;
+
+	*count = (int)value;
+
+	return 1;
+}
+
+/* Parse a byte count with an optional K, M, or G suffix. */
+int parsesize(const char *text, uint64_t *size)
+{
+	char *end;
+
+	if (*text < '0' || *text > '9')
+		return 0;
+
+	errno = 0;
+	unsigned long long value = strtoull(text, &end, 10);
+	if (errno != 0)
+		return 0;
+
+	int shift = 0;
+	switch (*end)
+	{
+		case 'k': case 'K': shift = 10; ++end; break;
+		case 'm': case 'M': shift = 20; ++end; break;
+		case 'g': case 'G': shift = 30; ++end; break;
+	}
+
+	if (*end != '\0' || value > (UINT64_MAX >> shift))
+		return 0;
+
+	*size = (uint64_t)value << shift;
+
+	return 1;
+}
+
+/* One input, which is loaded and, if it is to be compared, sorted by name. */
+struct collectionload
+{
+	char *path;
+	char *root;
+	int isdirectory;
+	struct directoryentrycollection *collection;
+	pthread_t thread;
+
+	/* The error that stopped a load run by collectionload_thread, or 0. */
+	char *error;
+};
+
+void collectionload_init(struct collectionload *load, char *path, char *root, struct stat *info)
+{
+	load->path = path;
+	load->root = root;
+	load->collection = 0;
+	load->error = 0;
+
+	if (use_stdin(path))
+		load->isdirectory = 0;
+	else if (S_ISDIR(info->st_mode))
+		load->isdirectory = 1;
+	else if (S_ISREG(info->st_mode))
+		load->isdirectory = 0;
+	else
+		fatalerror("%s is not a file or directory", path);
+}
+
+void collectionload_run(struct collectionload *load)
+{
+	if (load->isdirectory)
+		load->collection = directoryentrycollection_getfromfilesystem(load->path, load->root);
+	else
+		load->collection = directoryentrycollection_getfromfile(load->path, load->root);
+
+	if (load->collection && !ISFLAG(flags, F_PRINTHASHES) && !load->collection->sorted)
+		directoryentrycollection_sort(load->collection);
+}
+
+/* Run a load on a thread of its own, which ends early with load->error set if it fails. */
+void *collectionload_thread(void *arg)
+{
+	struct collectionload *load = arg;
+
+	loaderror = &load->error;
+	collectionload_run(load);
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	static struct getoptions_option opts[] = {
 		{ "hash", 'H', 0, 'H' },
+		{ "jobs", 'j', 1, 'j' },
+		{ "mmap-min", 0, 1, OPT_MMAP_MIN },
+		{ "format", 0, 1, OPT_FORMAT },
+		{ "sorted", 0, 0, OPT_SORTED },
+		{ "max-memory", 0, 1, OPT_MAX_MEMORY },
+		{ "reuse", 0, 1, OPT_REUSE },
+		{ "cache", 0, 1, OPT_CACHE },
+		{ "cache-max", 0, 1, OPT_CACHE_MAX },
+		{ "compact-cache", 0, 1, OPT_COMPACT_CACHE },
 		{ "within", 'w', 1, 'w' },
 		{ "verbose", 'v', 0, 'v' },
 		{ "short", 's', 0, 's' },
@@ -1185,6 +5309,12 @@ int main(int argc, char **argv)
 
 	program_name = argv[0];
 
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigbushandler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, 0);
+
 	char *argument = 0;
 
 	int option = 0;
@@ -1198,6 +5328,9 @@ int main(int argc, char **argv)
 	char *dir_to = 0;
 	char *within_from = 0;
 	char *within_to = 0;
+	char *reuse_from = 0;
+	char *cache_path = 0;
+	char *compact_path = 0;
 
 	int dir_from_position = 0;
 	int dir_to_position = 0;
@@ -1246,6 +5379,68 @@ int main(int argc, char **argv)
 				SETFLAG(flags, F_PRINTHASHES);
 				break;
 
+			case 'j':
+				if (!parsejobcount(argument, &jobcount)) {
+					warn("invalid number of jobs '%s'", argument);
+					errors = 1;
+				}
+
+				break;
+
+			case OPT_MMAP_MIN:
+				if (!parsesize(argument, &mmapthreshold)) {
+					warn("invalid size '%s'", argument);
+					errors = 1;
+				}
+
+				break;
+
+			case OPT_FORMAT:
+				flags &= ~(F_BINARYOUTPUT | F_V3OUTPUT);
+
+				if (strcmp(argument, "bin") == 0) {
+					SETFLAG(flags, F_BINARYOUTPUT);
+				} else if (strcmp(argument, "v3") == 0) {
+					SETFLAG(flags, F_V3OUTPUT);
+				} else if (strcmp(argument, "text") != 0) {
+					warn("invalid format '%s'", argument);
+					errors = 1;
+				}
+
+				break;
+
+			case OPT_SORTED:
+				SETFLAG(flags, F_SORTEDOUTPUT);
+				break;
+
+			case OPT_MAX_MEMORY:
+				if (!parsesize(argument, &maxmemory)) {
+					warn("invalid size '%s'", argument);
+					errors = 1;
+				}
+
+				break;
+
+			case OPT_REUSE:
+				reuse_from = argument;
+				break;
+
+			case OPT_CACHE:
+				cache_path = argument;
+				break;
+
+			case OPT_CACHE_MAX:
+				if (!parsesize(argument, &cachemaxsize)) {
+					warn("invalid size '%s'", argument);
+					errors = 1;
+				}
+
+				break;
+
+			case OPT_COMPACT_CACHE:
+				compact_path = argument;
+				break;
+
 			case 'V':
 				printf("%s %s\n", PROGRAM_NAME, DIRCHANGES_VERSION);
 				exit(0);
@@ -1282,6 +5477,23 @@ int main(int argc, char **argv)
 		errors = 1;
 	}
 
+	if (compact_path && !errors) {
+		if (dir_from != 0) {
+			warn("extra argument '%s'", dir_from);
+			fprintf(stderr, "Try '%s --help' for more information.\n", basename(argv[0]));
+			return 0;
+		}
+
+		if (!hashcache_compact(compact_path, cachemaxsize))
+			fatalerror("could not compact cache '%s'", compact_path);
+
+		return 0;
+	}
+
+	/* Only DIRHASH3 can mark a hashfile as sorted. */
+	if (ISFLAG(flags, F_SORTEDOUTPUT) && !ISFLAG(flags, F_BINARYOUTPUT))
+		SETFLAG(flags, F_V3OUTPUT);
+
 	if (!errors) {
 		if (!ISFLAG(flags, F_PRINTHASHES)) {
 			if (dir_from == 0 && dir_to == 0)
@@ -1308,41 +5520,120 @@ int main(int argc, char **argv)
 	struct stat f1stat;
 	struct stat f2stat;
 
+	output = outbuffer_new(STDOUT_FILENO, OUTPUT_BUFFER_SIZE);
+	if (!output)
+		fatalerror("out of memory!");
+
+	/* Two sorted hashfiles are merged as they are read instead of being loaded. */
+	if (!ISFLAG(flags, F_PRINTHASHES) && !use_stdin(dir_from) && !use_stdin(dir_to) &&
+		stat(dir_from, &f1stat) == 0 && S_ISREG(f1stat.st_mode) &&
+		stat(dir_to, &f2stat) == 0 && S_ISREG(f2stat.st_mode) &&
+		hashfile_issorted(dir_from) && hashfile_issorted(dir_to))
+	{
+		hashfile_comparesorted(dir_from, within_from, dir_to, within_to);
+		output_finish();
+		return 0;
+	}
+
+	if (reuse_from) {
+		if (use_stdin(reuse_from) && ((dir_from && use_stdin(dir_from)) || (dir_to && use_stdin(dir_to))))
+			fatalerror("cannot read twice from stdin");
+
+		reusecollection = directoryentrycollection_getfromfile(reuse_from, 0);
+		if (!reusecollection)
+			fatalerror("unable to read hashes from '%s'", reuse_from);
+
+		/* DIRHASH2 files and archives lack the times that tell unchanged files apart. */
+		if (!reusecollection->hasmetadata)
+			fatalerror("'%s' is not a DIRHASH3 hashfile or binary snapshot, which --reuse needs", reuse_from);
+
+		if (!reusecollection->sorted)
+			directoryentrycollection_sortby(reusecollection, 0);
+
+		reusetime_ns = snapshottime(reuse_from);
+	}
+
+	if (cache_path) {
+		hashcache = hashcache_open(cache_path, cachemaxsize);
+		if (!hashcache)
+			fatalerror("could not open cache '%s'", cache_path);
+	}
+
 	if (dir_from && use_stdin(dir_from) && dir_to && use_stdin(dir_to))
 		fatalerror("cannot read twice from stdin");
 
+	struct collectionload from;
+	struct collectionload to;
+
 	if (!use_stdin(dir_from) && stat(dir_from, &f1stat) != 0)
 		fatalerror("unable to read or open '%s'", dir_from);
 
-	if (S_ISDIR(f1stat.st_mode)) {
-		collection1 = directoryentrycollection_getfromfilesystem(dir_from, within_from);
-	} else if (S_ISREG(f1stat.st_mode) || use_stdin(dir_from)) {
-		collection1 = directoryentrycollection_getfromfile(dir_from, within_from);
-	} else {
-		fatalerror("%s is not a file or directory", dir_from);
-	}
+	collectionload_init(&from, dir_from, within_from, &f1stat);
 
 	if (dir_to) {
 		if (!use_stdin(dir_to) && stat(dir_to, &f2stat) != 0)
 			fatalerror("unable to read or open '%s'", dir_to);
 
-		if (S_ISDIR(f2stat.st_mode)) {
-			collection2 = directoryentrycollection_getfromfilesystem(dir_to, within_to);
-		} else if (S_ISREG(f2stat.st_mode) || use_stdin(dir_to)) {
-			collection2 = directoryentrycollection_getfromfile(dir_to, within_to);
-		} else {
-			fatalerror("%s is not a file or directory", dir_to);
+		collectionload_init(&to, dir_to, within_to, &f2stat);
+
+		/*
+		 * Each side is loaded and sorted on its own thread, and the merge
+		 * waits for both. Errors are reported here, FROM's before TO's.
+		 */
+		if (pthread_create(&from.thread, 0, collectionload_thread, &from) != 0)
+			fatalerror("could not create loading thread");
+
+		if (pthread_create(&to.thread, 0, collectionload_thread, &to) != 0)
+			fatalerror("could not create loading thread");
+
+		pthread_join(from.thread, 0);
+
+		if (from.error) {
+			pthread_detach(to.thread);
+			fatalerror("%s", from.error);
 		}
+
+		pthread_join(to.thread, 0);
+
+		if (to.error)
+			fatalerror("%s", to.error);
+
+		collection2 = to.collection;
+	} else if (from.isdirectory && ISFLAG(flags, F_PRINTHASHES) && !ISFLAG(flags, F_BINARYOUTPUT)) {
+		/* A snapshot's header needs every entry first, but hashes can go out as they are found. */
+		directoryentry_printfromfilesystem(from.path, from.root);
+	} else {
+		collectionload_run(&from);
 	}
 
+	collection1 = from.collection;
+
+	if (reusecollection)
+		fprintf(stderr, "%s: reused %zu digests, rehashed %zu files\n", program_name, reusedcount, rehashedcount);
+	else if (hashcache)
+		fprintf(stderr, "%s: found %zu digests in cache, rehashed %zu files\n", program_name, cachedcount, rehashedcount);
+
+	if (reusecollection)
+		directoryentrycollection_free(reusecollection);
+
+	if (hashcache && !hashcache_close(hashcache))
+		warn("could not update cache '%s'", cache_path);
+
 	if (ISFLAG(flags, F_VERBOSE))
 		fprintf(stderr, "\n");
 
 	if (ISFLAG(flags, F_PRINTHASHES))
-		directoryentrycollection_printhashes(collection1);
+	{
+		if (ISFLAG(flags, F_BINARYOUTPUT))
+			directoryentrycollection_writesnapshot(collection1, stdout);
+		else if (collection1)
+			directoryentrycollection_printhashes(collection1);
+	}
 	else
 		directoryentrycollection_compare(collection1, collection2, within_from, within_to);
 
+	output_finish();
+
 	if (collection2)
 		directoryentrycollection_free(collection2);
 
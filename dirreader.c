@@ -0,0 +1,164 @@
+/* dirreader Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+#define _GNU_SOURCE
+
+#include "dirreader.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*
+ * On Linux, directories are listed with getdents64 straight into a large
+ * caller-sized buffer, and entries are handed back as pointers into the
+ * packed records the kernel wrote there. Elsewhere this falls back to
+ * readdir.
+ */
+
+#ifdef SYS_getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+struct dirreader {
+    int fd;
+    char *buffer;
+    size_t size;
+    size_t pos;
+    size_t end;
+    DIR *dir;
+};
+
+struct dirreader *dirreader_new(size_t buffersize) {
+    struct dirreader *reader = malloc(sizeof(struct dirreader));
+    if (!reader)
+        return 0;
+
+    reader->buffer = malloc(buffersize);
+    if (!reader->buffer) {
+        free(reader);
+        return 0;
+    }
+
+    reader->fd = -1;
+    reader->size = buffersize;
+    reader->pos = 0;
+    reader->end = 0;
+    reader->dir = 0;
+
+    return reader;
+}
+
+int dirreader_open(struct dirreader *reader, int fd) {
+    reader->fd = fd;
+    reader->pos = 0;
+    reader->end = 0;
+
+#ifndef SYS_getdents64
+    reader->dir = fdopendir(fd);
+    if (!reader->dir) {
+        close(fd);
+        reader->fd = -1;
+        return DIRREADER_ERROR;
+    }
+#endif
+
+    return 1;
+}
+
+static int isdots(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+int dirreader_next(struct dirreader *reader, struct dirreader_entry *entry) {
+#ifdef SYS_getdents64
+    while (1) {
+        if (reader->pos >= reader->end) {
+            long read;
+
+            do {
+                read = syscall(SYS_getdents64, reader->fd, reader->buffer, reader->size);
+            } while (read < 0 && errno == EINTR);
+
+            if (read < 0)
+                return DIRREADER_ERROR;
+
+            if (read == 0)
+                return DIRREADER_END;
+
+            reader->pos = 0;
+            reader->end = read;
+        }
+
+        struct linux_dirent64 *d = (struct linux_dirent64 *) (reader->buffer + reader->pos);
+        reader->pos += d->d_reclen;
+
+        if (isdots(d->d_name))
+            continue;
+
+        entry->name = d->d_name;
+        entry->type = d->d_type;
+
+        return 1;
+    }
+#else
+    struct dirent *d;
+
+    errno = 0;
+    while ((d = readdir(reader->dir)) != 0) {
+        if (isdots(d->d_name))
+            continue;
+
+        entry->name = d->d_name;
+        entry->type = d->d_type;
+
+        return 1;
+    }
+
+    return errno != 0 ? DIRREADER_ERROR : DIRREADER_END;
+#endif
+}
+
+void dirreader_close(struct dirreader *reader) {
+    if (reader->dir)
+        closedir(reader->dir);
+    else if (reader->fd >= 0)
+        close(reader->fd);
+
+    reader->dir = 0;
+    reader->fd = -1;
+}
+
+void dirreader_free(struct dirreader *reader) {
+    dirreader_close(reader);
+
+    free(reader->buffer);
+    free(reader);
+}
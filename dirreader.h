@@ -0,0 +1,54 @@
+/* dirreader Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+#ifndef DIRREADER_H
+#define DIRREADER_H
+
+#include <stddef.h>
+
+#define DIRREADER_END    0
+#define DIRREADER_ERROR  -1
+
+struct dirreader_entry {
+    const char *name;
+    unsigned char type;
+};
+
+struct dirreader;
+
+/* Create a reader with a buffer of buffersize bytes, reusable across directories. */
+struct dirreader *dirreader_new(size_t buffersize);
+
+/* Start listing the directory open as fd. The reader takes ownership of fd. */
+int dirreader_open(struct dirreader *reader, int fd);
+
+/*
+ * Fetch the next entry, skipping "." and "..". Returns 1, DIRREADER_END or
+ * DIRREADER_ERROR. entry->name stays valid until the next call.
+ */
+int dirreader_next(struct dirreader *reader, struct dirreader_entry *entry);
+
+/* Finish listing and close the directory. */
+void dirreader_close(struct dirreader *reader);
+
+void dirreader_free(struct dirreader *reader);
+
+#endif
@@ -0,0 +1,471 @@
+/* hashcache Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+#define _GNU_SOURCE
+
+#include "hashcache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * The cache file is a header followed by an open-addressed table of slots,
+ * probed linearly from a hash of the key. A slot's stamp, the time it was
+ * last used, is zero while the slot is empty and is always written last.
+ * The table only ever changes by filling empty slots in place or by writing
+ * a whole new file and renaming it over the old one, which leaves existing
+ * mappings intact, so lookups need no lock. Writers serialize on an
+ * exclusive flock of the file.
+ */
+
+#define HASHCACHE_MAGIC "DCHCACHE"
+#define HASHCACHE_VERSION 1
+#define HASHCACHE_MIN_SLOTS 1024
+#define HASHCACHE_REFRESH_SECONDS 86400
+#define HASHCACHE_RACY_SECONDS 2
+
+struct hashcache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t slotsize;
+    uint64_t slotcount;
+    uint64_t used;
+    uint64_t reserved[4];
+};
+
+struct hashcache_slot {
+    struct hashcache_key key;
+    uint64_t stamp;
+    unsigned char digest[HASHCACHE_DIGEST_SIZE];
+};
+
+struct hashcache_table {
+    struct hashcache_header *header;
+    size_t mapsize;
+    struct hashcache_slot *slots;
+    uint64_t mask;
+};
+
+struct hashcache {
+    char *path;
+    uint64_t maxbytes;
+    int fd;
+    int writable;
+    uint64_t now;
+    struct hashcache_table table;
+    struct hashcache_slot *pending;
+    size_t pendingcount;
+    size_t pendingallocated;
+    pthread_mutex_t pendinglock;
+};
+
+static uint64_t hashcache_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t hashcache_hash(const struct hashcache_key *key) {
+    uint64_t h = hashcache_mix(key->inode);
+    h = hashcache_mix(h ^ key->device);
+    h = hashcache_mix(h ^ key->size);
+    h = hashcache_mix(h ^ (uint64_t)key->mtime_ns);
+    h = hashcache_mix(h ^ (uint64_t)key->ctime_ns);
+    return h;
+}
+
+/* Map the table in fd. A missing or unrecognized table maps as empty. */
+static int hashcache_table_map(struct hashcache_table *table, int fd, int writable) {
+    struct stat st;
+
+    table->header = 0;
+    table->mapsize = 0;
+    table->slots = 0;
+    table->mask = 0;
+
+    if (fstat(fd, &st) != 0)
+        return 0;
+
+    if ((size_t)st.st_size < sizeof(struct hashcache_header))
+        return 1;
+
+    void *map = mmap(0, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+
+    struct hashcache_header *header = map;
+    uint64_t count = header->slotcount;
+
+    if (memcmp(header->magic, HASHCACHE_MAGIC, 8) != 0 || header->version != HASHCACHE_VERSION ||
+        header->slotsize != sizeof(struct hashcache_slot) || count == 0 || (count & (count - 1)) != 0 ||
+        (uint64_t)st.st_size != sizeof(struct hashcache_header) + count * sizeof(struct hashcache_slot)) {
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    table->header = header;
+    table->mapsize = st.st_size;
+    table->slots = (struct hashcache_slot *)(header + 1);
+    table->mask = count - 1;
+
+    return 1;
+}
+
+static void hashcache_table_unmap(struct hashcache_table *table) {
+    if (table->header)
+        munmap(table->header, table->mapsize);
+
+    table->header = 0;
+}
+
+static struct hashcache_slot *hashcache_table_find(struct hashcache_table *table, const struct hashcache_key *key) {
+    if (!table->header)
+        return 0;
+
+    uint64_t index = hashcache_hash(key) & table->mask;
+    uint64_t probes;
+
+    for (probes = 0; probes <= table->mask; ++probes) {
+        struct hashcache_slot *slot = &table->slots[index];
+
+        if (__atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE) == 0)
+            return 0;
+
+        if (memcmp(&slot->key, key, sizeof(struct hashcache_key)) == 0)
+            return slot;
+
+        index = (index + 1) & table->mask;
+    }
+
+    return 0;
+}
+
+/* Fill an empty slot with entry unless its key is present. Returns 0 if the table is full. */
+static int hashcache_table_insert(struct hashcache_table *table, const struct hashcache_slot *entry) {
+    uint64_t index = hashcache_hash(&entry->key) & table->mask;
+    uint64_t probes;
+
+    for (probes = 0; probes <= table->mask; ++probes) {
+        struct hashcache_slot *slot = &table->slots[index];
+
+        if (slot->stamp == 0) {
+            slot->key = entry->key;
+            memcpy(slot->digest, entry->digest, HASHCACHE_DIGEST_SIZE);
+            __atomic_store_n(&slot->stamp, entry->stamp, __ATOMIC_RELEASE);
+
+            table->header->used++;
+            return 1;
+        }
+
+        if (memcmp(&slot->key, &entry->key, sizeof(struct hashcache_key)) == 0)
+            return 1;
+
+        index = (index + 1) & table->mask;
+    }
+
+    return 0;
+}
+
+/*
+ * Open and exclusively lock the file currently at path, retrying if another
+ * process replaces it between the open and the lock.
+ */
+static int hashcache_lock(const char *path) {
+    while (1) {
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return -1;
+
+        int result;
+        while ((result = flock(fd, LOCK_EX)) != 0 && errno == EINTR)
+            ;
+
+        struct stat locked, current;
+        if (result == 0 && fstat(fd, &locked) == 0 && stat(path, &current) == 0 &&
+            locked.st_dev == current.st_dev && locked.st_ino == current.st_ino)
+            return fd;
+
+        close(fd);
+
+        if (result != 0)
+            return -1;
+    }
+}
+
+static int hashcache_comparebystamp(const void *a, const void *b) {
+    const struct hashcache_slot *s1 = a;
+    const struct hashcache_slot *s2 = b;
+
+    return s1->stamp < s2->stamp ? 1 : s1->stamp > s2->stamp ? -1 : 0;
+}
+
+/*
+ * Write the entries of table and extra to a new file and rename it over path.
+ * The new table leaves half its slots free for later additions, or with
+ * compact set, only as many as keep it at most three quarters full. Only the
+ * most recently used entries are kept if the file would exceed maxbytes. fd
+ * is the locked current file.
+ */
+static int hashcache_rebuild(const char *path, int fd, struct hashcache_table *table, const struct hashcache_slot *extra, size_t extracount, uint64_t maxbytes, int compact) {
+    size_t count = extracount;
+    uint64_t x;
+
+    if (table->header)
+        for (x = 0; x <= table->mask; ++x)
+            if (table->slots[x].stamp != 0)
+                ++count;
+
+    struct hashcache_slot *entries = malloc(sizeof(struct hashcache_slot) * (count + 1));
+    if (!entries)
+        return 0;
+
+    size_t n = 0;
+    if (table->header)
+        for (x = 0; x <= table->mask; ++x)
+            if (table->slots[x].stamp != 0)
+                entries[n++] = table->slots[x];
+
+    if (extracount > 0)
+        memcpy(entries + n, extra, sizeof(struct hashcache_slot) * extracount);
+    n += extracount;
+
+    uint64_t slotcount = HASHCACHE_MIN_SLOTS;
+    while (slotcount < (compact ? (uint64_t)n * 4 / 3 : (uint64_t)n * 2))
+        slotcount *= 2;
+
+    uint64_t maxslots = HASHCACHE_MIN_SLOTS;
+    while (sizeof(struct hashcache_header) + maxslots * 2 * sizeof(struct hashcache_slot) <= maxbytes)
+        maxslots *= 2;
+
+    if (slotcount > maxslots) {
+        slotcount = maxslots;
+
+        qsort(entries, n, sizeof(struct hashcache_slot), hashcache_comparebystamp);
+        if (n > (compact ? slotcount / 4 * 3 : slotcount / 2))
+            n = compact ? slotcount / 4 * 3 : slotcount / 2;
+    }
+
+    size_t size = sizeof(struct hashcache_header) + slotcount * sizeof(struct hashcache_slot);
+
+    char *temppath = malloc(strlen(path) + 8);
+    if (!temppath) {
+        free(entries);
+        return 0;
+    }
+
+    sprintf(temppath, "%s.XXXXXX", path);
+
+    int ok = 0;
+    int tempfd = mkstemp(temppath);
+    if (tempfd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+            fchmod(tempfd, st.st_mode & 0777);
+
+        void *map = MAP_FAILED;
+        if (ftruncate(tempfd, size) == 0)
+            map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, tempfd, 0);
+
+        if (map != MAP_FAILED) {
+            struct hashcache_table fresh;
+            fresh.header = map;
+            fresh.mapsize = size;
+            fresh.slots = (struct hashcache_slot *)(fresh.header + 1);
+            fresh.mask = slotcount - 1;
+
+            memcpy(fresh.header->magic, HASHCACHE_MAGIC, 8);
+            fresh.header->version = HASHCACHE_VERSION;
+            fresh.header->slotsize = sizeof(struct hashcache_slot);
+            fresh.header->slotcount = slotcount;
+            fresh.header->used = 0;
+
+            for (x = 0; x < n; ++x)
+                hashcache_table_insert(&fresh, &entries[x]);
+
+            ok = munmap(map, size) == 0 && rename(temppath, path) == 0;
+        }
+
+        close(tempfd);
+
+        if (!ok)
+            unlink(temppath);
+    }
+
+    free(temppath);
+    free(entries);
+
+    return ok;
+}
+
+struct hashcache *hashcache_open(const char *path, uint64_t maxbytes) {
+    struct hashcache *cache = calloc(1, sizeof(struct hashcache));
+    if (!cache)
+        return 0;
+
+    cache->path = strdup(path);
+    if (!cache->path) {
+        free(cache);
+        return 0;
+    }
+
+    cache->maxbytes = maxbytes;
+    cache->writable = 1;
+    cache->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    /* A cache we may not write to is still useful for lookups. */
+    if (cache->fd < 0 && (errno == EACCES || errno == EROFS)) {
+        cache->writable = 0;
+        cache->fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    if (cache->fd < 0 || !hashcache_table_map(&cache->table, cache->fd, cache->writable)) {
+        if (cache->fd >= 0)
+            close(cache->fd);
+        free(cache->path);
+        free(cache);
+        return 0;
+    }
+
+    time_t now = time(0);
+    cache->now = now > 0 ? (uint64_t)now : 1;
+
+    pthread_mutex_init(&cache->pendinglock, 0);
+
+    return cache;
+}
+
+int hashcache_lookup(struct hashcache *cache, const struct hashcache_key *key, unsigned char *digest) {
+    struct hashcache_slot *slot = hashcache_table_find(&cache->table, key);
+    if (!slot)
+        return 0;
+
+    memcpy(digest, slot->digest, HASHCACHE_DIGEST_SIZE);
+
+    /* Refresh the stamp that eviction goes by, at most once a day per entry. */
+    if (cache->writable && __atomic_load_n(&slot->stamp, __ATOMIC_RELAXED) + HASHCACHE_REFRESH_SECONDS < cache->now)
+        __atomic_store_n(&slot->stamp, cache->now, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+void hashcache_add(struct hashcache *cache, const struct hashcache_key *key, const unsigned char *digest) {
+    /*
+     * A file changed within a timestamp tick of being hashed could change
+     * again without its times moving, so digests of files changed shortly
+     * before the cache was opened, or since, are not kept.
+     */
+    if (key->ctime_ns / 1000000000 + HASHCACHE_RACY_SECONDS >= (int64_t)cache->now)
+        return;
+
+    pthread_mutex_lock(&cache->pendinglock);
+
+    if (cache->pendingcount == cache->pendingallocated) {
+        size_t allocated = cache->pendingallocated ? cache->pendingallocated * 2 : 1024;
+        struct hashcache_slot *pending = realloc(cache->pending, sizeof(struct hashcache_slot) * allocated);
+        if (!pending) {
+            pthread_mutex_unlock(&cache->pendinglock);
+            return;
+        }
+
+        cache->pending = pending;
+        cache->pendingallocated = allocated;
+    }
+
+    struct hashcache_slot *slot = &cache->pending[cache->pendingcount++];
+    slot->key = *key;
+    slot->stamp = cache->now;
+    memcpy(slot->digest, digest, HASHCACHE_DIGEST_SIZE);
+
+    pthread_mutex_unlock(&cache->pendinglock);
+}
+
+/* Merge pending digests into whichever file is at path now. */
+static int hashcache_commit(struct hashcache *cache) {
+    int fd = hashcache_lock(cache->path);
+    if (fd < 0)
+        return 0;
+
+    struct hashcache_table table;
+    if (!hashcache_table_map(&table, fd, 1)) {
+        close(fd);
+        return 0;
+    }
+
+    size_t done = 0;
+
+    /*
+     * Fill free slots in place while the table stays at most three quarters
+     * full and within the size limit, which may have been lowered since.
+     */
+    if (table.header && table.header->used + cache->pendingcount <= table.header->slotcount / 4 * 3 && table.mapsize <= cache->maxbytes)
+        while (done < cache->pendingcount && hashcache_table_insert(&table, &cache->pending[done]))
+            ++done;
+
+    int ok = 1;
+    if (done < cache->pendingcount)
+        ok = hashcache_rebuild(cache->path, fd, &table, cache->pending + done, cache->pendingcount - done, cache->maxbytes, 0);
+
+    hashcache_table_unmap(&table);
+    close(fd);
+
+    return ok;
+}
+
+int hashcache_close(struct hashcache *cache) {
+    int ok = 1;
+
+    if (cache->pendingcount > 0)
+        ok = cache->writable && hashcache_commit(cache);
+
+    hashcache_table_unmap(&cache->table);
+    close(cache->fd);
+    pthread_mutex_destroy(&cache->pendinglock);
+    free(cache->pending);
+    free(cache->path);
+    free(cache);
+
+    return ok;
+}
+
+int hashcache_compact(const char *path, uint64_t maxbytes) {
+    int fd = hashcache_lock(path);
+    if (fd < 0)
+        return 0;
+
+    struct hashcache_table table;
+    int ok = hashcache_table_map(&table, fd, 0) && hashcache_rebuild(path, fd, &table, 0, 0, maxbytes, 1);
+
+    hashcache_table_unmap(&table);
+    close(fd);
+
+    return ok;
+}
@@ -0,0 +1,72 @@
+/* hashcache Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include <stdint.h>
+
+#define HASHCACHE_DIGEST_SIZE 32
+
+/*
+ * Identifies one state of one file; any change to the file changes ctime_ns,
+ * except that changes within one timestamp tick may leave it the same.
+ */
+struct hashcache_key {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+};
+
+struct hashcache;
+
+/*
+ * Open the cache file at path, creating it if necessary. The file is kept
+ * below maxbytes by evicting the least recently used digests. Returns 0 on
+ * failure.
+ */
+struct hashcache *hashcache_open(const char *path, uint64_t maxbytes);
+
+/*
+ * Look up the digest stored for key. Returns 1 and fills in digest on a hit.
+ * Lookups and additions may run concurrently with each other.
+ */
+int hashcache_lookup(struct hashcache *cache, const struct hashcache_key *key, unsigned char *digest);
+
+/*
+ * Remember a digest; it is written to the file by hashcache_close. Files
+ * whose ctime is within a couple of seconds of the cache being opened, or
+ * later, are skipped, since their key may outlive a change. Thread-safe.
+ */
+void hashcache_add(struct hashcache *cache, const struct hashcache_key *key, const unsigned char *digest);
+
+/*
+ * Write any new digests to the file and release the cache. Returns 0 if the
+ * file could not be updated.
+ */
+int hashcache_close(struct hashcache *cache);
+
+/* Rewrite the cache file at path at the smallest size its contents allow. */
+int hashcache_compact(const char *path, uint64_t maxbytes);
+
+#endif
@@ -0,0 +1,279 @@
+/* ioring Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+#define _GNU_SOURCE
+
+#include "ioring.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*
+ * A minimal io_uring client speaking to the kernel through the raw system
+ * calls, so no liburing is needed. Requests go into the shared submission
+ * ring and are started in bulk by a single io_uring_enter, which also waits
+ * for completions. Elsewhere, ioring_new always fails.
+ */
+
+#if defined(SYS_io_uring_setup) && defined(SYS_io_uring_enter) && defined(SYS_io_uring_register)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+
+struct ioring {
+    int fd;
+
+    void *sqmap;
+    size_t sqmapsize;
+    void *cqmap;
+    size_t cqmapsize;
+    struct io_uring_sqe *sqes;
+    size_t sqessize;
+
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned sqmask;
+    unsigned *sqarray;
+    unsigned sqentries;
+    unsigned sqqueued;
+    unsigned sqsubmitted;
+
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned cqmask;
+    struct io_uring_cqe *cqes;
+};
+
+static int ioring_supports(int fd, const int *ops, int count) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe)
+        return 0;
+
+    int supported = syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    int x;
+    for (x = 0; supported && x < count; ++x)
+        if (ops[x] > probe->last_op || !(probe->ops[ops[x]].flags & IO_URING_OP_SUPPORTED))
+            supported = 0;
+
+    free(probe);
+
+    return supported;
+}
+
+struct ioring *ioring_new(unsigned entries) {
+    static const int ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return 0;
+
+    if (!(params.features & IORING_FEAT_NODROP) || !ioring_supports(fd, ops, sizeof(ops) / sizeof(ops[0]))) {
+        close(fd);
+        return 0;
+    }
+
+    struct ioring *ring = calloc(1, sizeof(struct ioring));
+    if (!ring) {
+        close(fd);
+        return 0;
+    }
+
+    ring->fd = fd;
+    ring->sqmapsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqmapsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels share a single mapping between both rings. */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqmapsize > ring->sqmapsize)
+            ring->sqmapsize = ring->cqmapsize;
+        ring->cqmapsize = 0;
+    }
+
+    ring->sqmap = mmap(0, ring->sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sqmap == MAP_FAILED) {
+        ring->sqmap = 0;
+        ioring_free(ring);
+        return 0;
+    }
+
+    if (ring->cqmapsize == 0) {
+        ring->cqmap = ring->sqmap;
+    } else {
+        ring->cqmap = mmap(0, ring->cqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cqmap == MAP_FAILED) {
+            ring->cqmap = 0;
+            ioring_free(ring);
+            return 0;
+        }
+    }
+
+    ring->sqes = mmap(0, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = 0;
+        ioring_free(ring);
+        return 0;
+    }
+
+    char *sq = ring->sqmap;
+    ring->sqhead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqtail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqmask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqarray = (unsigned *)(sq + params.sq_off.array);
+    ring->sqentries = params.sq_entries;
+    ring->sqqueued = *ring->sqtail;
+    ring->sqsubmitted = ring->sqqueued;
+
+    char *cq = ring->cqmap;
+    ring->cqhead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqtail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqmask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+static struct io_uring_sqe *ioring_queue(struct ioring *ring, int opcode, int fd, void *user) {
+    unsigned head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+    if (ring->sqqueued - head >= ring->sqentries)
+        return 0;
+
+    unsigned index = ring->sqqueued & ring->sqmask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)user;
+
+    ring->sqarray[index] = index;
+    ring->sqqueued++;
+
+    return sqe;
+}
+
+int ioring_openat(struct ioring *ring, int dirfd, const char *path, int flags, void *user) {
+    struct io_uring_sqe *sqe = ioring_queue(ring, IORING_OP_OPENAT, dirfd, user);
+    if (!sqe)
+        return 0;
+
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->open_flags = flags;
+
+    return 1;
+}
+
+int ioring_read(struct ioring *ring, int fd, void *buffer, size_t count, uint64_t offset, void *user) {
+    struct io_uring_sqe *sqe = ioring_queue(ring, IORING_OP_READ, fd, user);
+    if (!sqe)
+        return 0;
+
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = count;
+    sqe->off = offset;
+
+    return 1;
+}
+
+int ioring_close(struct ioring *ring, int fd, void *user) {
+    return ioring_queue(ring, IORING_OP_CLOSE, fd, user) != 0;
+}
+
+int ioring_submit(struct ioring *ring, unsigned wait) {
+    __atomic_store_n(ring->sqtail, ring->sqqueued, __ATOMIC_RELEASE);
+
+    while (1) {
+        unsigned pending = ring->sqqueued - ring->sqsubmitted;
+
+        int result = syscall(SYS_io_uring_enter, ring->fd, pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+        if (result >= 0) {
+            ring->sqsubmitted += result;
+            if (ring->sqsubmitted == ring->sqqueued)
+                return 0;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+    }
+}
+
+int ioring_next(struct ioring *ring, struct ioring_completion *completion) {
+    unsigned head = *ring->cqhead;
+    if (head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqmask];
+    completion->user = (void *)(uintptr_t)cqe->user_data;
+    completion->result = cqe->res;
+
+    __atomic_store_n(ring->cqhead, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+void ioring_free(struct ioring *ring) {
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqessize);
+    if (ring->cqmap && ring->cqmap != ring->sqmap)
+        munmap(ring->cqmap, ring->cqmapsize);
+    if (ring->sqmap)
+        munmap(ring->sqmap, ring->sqmapsize);
+
+    close(ring->fd);
+    free(ring);
+}
+
+#else
+
+struct ioring *ioring_new(unsigned entries) {
+    return 0;
+}
+
+int ioring_openat(struct ioring *ring, int dirfd, const char *path, int flags, void *user) {
+    return 0;
+}
+
+int ioring_read(struct ioring *ring, int fd, void *buffer, size_t count, uint64_t offset, void *user) {
+    return 0;
+}
+
+int ioring_close(struct ioring *ring, int fd, void *user) {
+    return 0;
+}
+
+int ioring_submit(struct ioring *ring, unsigned wait) {
+    return -1;
+}
+
+int ioring_next(struct ioring *ring, struct ioring_completion *completion) {
+    return 0;
+}
+
+void ioring_free(struct ioring *ring) {
+}
+
+#endif
@@ -0,0 +1,61 @@
+/* ioring Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+#ifndef IORING_H
+#define IORING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ioring_completion {
+    void *user;
+    int result;
+};
+
+struct ioring;
+
+/*
+ * Create a ring able to hold entries queued requests. Returns 0 if the
+ * system has no io_uring, or one lacking the operations used here, in which
+ * case callers should do their I/O synchronously.
+ */
+struct ioring *ioring_new(unsigned entries);
+
+/*
+ * Queue a request; user is handed back with its completion. Requests are not
+ * started until ioring_submit is called. Each returns 0 if the ring is full.
+ */
+int ioring_openat(struct ioring *ring, int dirfd, const char *path, int flags, void *user);
+int ioring_read(struct ioring *ring, int fd, void *buffer, size_t count, uint64_t offset, void *user);
+int ioring_close(struct ioring *ring, int fd, void *user);
+
+/*
+ * Start all queued requests and wait until at least wait of them have
+ * completed. Returns -1 on failure.
+ */
+int ioring_submit(struct ioring *ring, unsigned wait);
+
+/* Fetch a completion without blocking. Returns 1, or 0 if none is ready. */
+int ioring_next(struct ioring *ring, struct ioring_completion *completion);
+
+void ioring_free(struct ioring *ring);
+
+#endif
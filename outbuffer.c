@@ -0,0 +1,221 @@
+/* outbuffer Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "outbuffer.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Long enough for any 64-bit integer in decimal, sign included. */
+#define OUTBUFFER_NUMBER_SIZE 20
+
+struct outbuffer {
+    int fd;
+    int error;
+    char *buffer;
+    size_t size;
+    size_t used;
+};
+
+#define HEXROW(h) h"0" h"1" h"2" h"3" h"4" h"5" h"6" h"7" h"8" h"9" h"a" h"b" h"c" h"d" h"e" h"f"
+#define DECROW(d) d"0" d"1" d"2" d"3" d"4" d"5" d"6" d"7" d"8" d"9"
+
+/* Every byte value as two hex digits, and every number below 100 as two decimal digits. */
+static const char hexpairs[] =
+    HEXROW("0") HEXROW("1") HEXROW("2") HEXROW("3") HEXROW("4") HEXROW("5") HEXROW("6") HEXROW("7")
+    HEXROW("8") HEXROW("9") HEXROW("a") HEXROW("b") HEXROW("c") HEXROW("d") HEXROW("e") HEXROW("f");
+
+static const char decpairs[] =
+    DECROW("0") DECROW("1") DECROW("2") DECROW("3") DECROW("4")
+    DECROW("5") DECROW("6") DECROW("7") DECROW("8") DECROW("9");
+
+struct outbuffer *outbuffer_new(int fd, size_t size) {
+    struct outbuffer *out = malloc(sizeof(struct outbuffer));
+    if (!out)
+        return 0;
+
+    if (size < OUTBUFFER_NUMBER_SIZE * 4)
+        size = OUTBUFFER_NUMBER_SIZE * 4;
+
+    out->buffer = malloc(size);
+    if (!out->buffer) {
+        free(out);
+        return 0;
+    }
+
+    out->fd = fd;
+    out->error = 0;
+    out->size = size;
+    out->used = 0;
+
+    return out;
+}
+
+/* Write all of iov, picking up after short writes. */
+static void outbuffer_writev(struct outbuffer *out, struct iovec *iov, int count) {
+    while (count > 0 && !out->error) {
+        ssize_t written = writev(out->fd, iov, count);
+
+        if (written < 0) {
+            if (errno != EINTR)
+                out->error = errno;
+            continue;
+        }
+
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+int outbuffer_flush(struct outbuffer *out) {
+    struct iovec iov;
+
+    iov.iov_base = out->buffer;
+    iov.iov_len = out->used;
+
+    if (out->used > 0)
+        outbuffer_writev(out, &iov, 1);
+
+    out->used = 0;
+
+    return !out->error;
+}
+
+/* Make room for at least length more bytes. */
+static char *outbuffer_reserve(struct outbuffer *out, size_t length) {
+    if (out->size - out->used < length)
+        outbuffer_flush(out);
+
+    return out->buffer + out->used;
+}
+
+void outbuffer_write(struct outbuffer *out, const void *data, size_t length) {
+    if (out->size - out->used >= length) {
+        memcpy(out->buffer + out->used, data, length);
+        out->used += length;
+        return;
+    }
+
+    if (length < out->size) {
+        outbuffer_flush(out);
+        memcpy(out->buffer, data, length);
+        out->used = length;
+        return;
+    }
+
+    struct iovec iov[2];
+
+    iov[0].iov_base = out->buffer;
+    iov[0].iov_len = out->used;
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = length;
+
+    outbuffer_writev(out, iov, 2);
+
+    out->used = 0;
+}
+
+void outbuffer_puts(struct outbuffer *out, const char *s) {
+    outbuffer_write(out, s, strlen(s));
+}
+
+void outbuffer_putc(struct outbuffer *out, char c) {
+    *outbuffer_reserve(out, 1) = c;
+    ++out->used;
+}
+
+/* Format n into the end of the OUTBUFFER_NUMBER_SIZE bytes ending at end, returning where it starts. */
+static char *formatu64(char *end, uint64_t n) {
+    char *p = end;
+
+    while (n >= 100) {
+        p -= 2;
+        memcpy(p, decpairs + (n % 100) * 2, 2);
+        n /= 100;
+    }
+
+    if (n >= 10) {
+        p -= 2;
+        memcpy(p, decpairs + n * 2, 2);
+    } else {
+        *--p = '0' + n;
+    }
+
+    return p;
+}
+
+void outbuffer_putu64(struct outbuffer *out, uint64_t n) {
+    char digits[OUTBUFFER_NUMBER_SIZE];
+    char *start = formatu64(digits + sizeof(digits), n);
+
+    outbuffer_write(out, start, digits + sizeof(digits) - start);
+}
+
+void outbuffer_puti64(struct outbuffer *out, int64_t n) {
+    char digits[OUTBUFFER_NUMBER_SIZE];
+    char *start;
+
+    if (n < 0) {
+        start = formatu64(digits + sizeof(digits), -(uint64_t)n);
+        *--start = '-';
+    } else {
+        start = formatu64(digits + sizeof(digits), n);
+    }
+
+    outbuffer_write(out, start, digits + sizeof(digits) - start);
+}
+
+void outbuffer_puthex(struct outbuffer *out, const unsigned char *bytes, size_t count) {
+    while (count > 0) {
+        size_t chunk = out->size / 2 < count ? out->size / 2 : count;
+        char *p = outbuffer_reserve(out, chunk * 2);
+        size_t x;
+
+        for (x = 0; x < chunk; ++x)
+            memcpy(p + x * 2, hexpairs + bytes[x] * 2, 2);
+
+        out->used += chunk * 2;
+        bytes += chunk;
+        count -= chunk;
+    }
+}
+
+int outbuffer_error(const struct outbuffer *out) {
+    return out->error;
+}
+
+void outbuffer_free(struct outbuffer *out) {
+    if (!out)
+        return;
+
+    free(out->buffer);
+    free(out);
+}
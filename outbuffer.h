@@ -0,0 +1,61 @@
+/* outbuffer Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+#ifndef OUTBUFFER_H
+#define OUTBUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Buffered output straight to a file descriptor, with formatting for the
+ * few kinds of field dirchanges writes. Once a write fails, everything
+ * after it is dropped and the error is kept for outbuffer_error.
+ */
+struct outbuffer;
+
+/* Create a buffer of size bytes in front of fd, which stays open and owned by the caller. */
+struct outbuffer *outbuffer_new(int fd, size_t size);
+
+/* Append length bytes. Writes too large to buffer go out together with what is buffered. */
+void outbuffer_write(struct outbuffer *out, const void *data, size_t length);
+
+void outbuffer_puts(struct outbuffer *out, const char *s);
+
+void outbuffer_putc(struct outbuffer *out, char c);
+
+/* Append n in decimal. */
+void outbuffer_putu64(struct outbuffer *out, uint64_t n);
+void outbuffer_puti64(struct outbuffer *out, int64_t n);
+
+/* Append count bytes as lowercase hexadecimal digits. */
+void outbuffer_puthex(struct outbuffer *out, const unsigned char *bytes, size_t count);
+
+/* Write out everything buffered. Returns 1 on success, 0 if any write failed. */
+int outbuffer_flush(struct outbuffer *out);
+
+/* The errno of the first failed write, or 0. */
+int outbuffer_error(const struct outbuffer *out);
+
+/* Release the buffer without flushing it. */
+void outbuffer_free(struct outbuffer *out);
+
+#endif
@@ -0,0 +1,157 @@
+/* patharena Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "patharena.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct patharena_block {
+    struct patharena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+/* The head of the block list is the one being carved up. */
+struct patharena {
+    struct patharena_block *blocks;
+    size_t blocksize;
+    size_t total;
+};
+
+struct patharena *patharena_new(size_t blocksize) {
+    struct patharena *arena = malloc(sizeof(struct patharena));
+    if (!arena)
+        return 0;
+
+    arena->blocks = 0;
+    arena->blocksize = blocksize;
+    arena->total = 0;
+
+    return arena;
+}
+
+char *patharena_alloc(struct patharena *arena, size_t size) {
+    struct patharena_block *block = arena->blocks;
+
+    if (!block || block->size - block->used < size) {
+        size_t blocksize = size > arena->blocksize ? size : arena->blocksize;
+
+        block = malloc(sizeof(struct patharena_block) + blocksize);
+        if (!block)
+            return 0;
+
+        block->size = blocksize;
+        block->used = 0;
+
+        /* An oversized string gets a block of its own behind the current one. */
+        if (blocksize > arena->blocksize && arena->blocks) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+
+        arena->total += blocksize;
+    }
+
+    char *p = block->data + block->used;
+    block->used += size;
+
+    return p;
+}
+
+char *patharena_copy(struct patharena *arena, const char *s, size_t length) {
+    char *p = patharena_alloc(arena, length + 1);
+    if (!p)
+        return 0;
+
+    memcpy(p, s, length);
+    p[length] = '\0';
+
+    return p;
+}
+
+void patharena_reset(struct patharena *arena) {
+    struct patharena_block *keep = 0;
+    struct patharena_block *block = arena->blocks;
+
+    while (block) {
+        struct patharena_block *next = block->next;
+
+        if (!keep && block->size == arena->blocksize)
+            keep = block;
+        else
+            free(block);
+
+        block = next;
+    }
+
+    arena->blocks = keep;
+    arena->total = 0;
+
+    if (keep) {
+        keep->next = 0;
+        keep->used = 0;
+        arena->total = keep->size;
+    }
+}
+
+void patharena_adopt(struct patharena *to, struct patharena *from) {
+    if (!from->blocks)
+        return;
+
+    struct patharena_block *last = from->blocks;
+    while (last->next)
+        last = last->next;
+
+    /* Keep carving up to's current block; from's blocks go behind it. */
+    if (to->blocks) {
+        last->next = to->blocks->next;
+        to->blocks->next = from->blocks;
+    } else {
+        to->blocks = from->blocks;
+    }
+
+    to->total += from->total;
+
+    from->blocks = 0;
+    from->total = 0;
+}
+
+size_t patharena_size(const struct patharena *arena) {
+    return arena->total;
+}
+
+void patharena_free(struct patharena *arena) {
+    if (!arena)
+        return;
+
+    struct patharena_block *block = arena->blocks;
+    while (block) {
+        struct patharena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(arena);
+}
@@ -0,0 +1,54 @@
+/* patharena Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+#ifndef PATHARENA_H
+#define PATHARENA_H
+
+#include <stddef.h>
+
+/*
+ * A bump allocator for path strings. Strings are carved out of large blocks
+ * and never move or get freed one at a time; they all go away together when
+ * the arena is reset or freed.
+ */
+struct patharena;
+
+/* Create an arena that allocates blocks of blocksize bytes, or larger for longer strings. */
+struct patharena *patharena_new(size_t blocksize);
+
+/* Allocate size bytes, or return 0 if out of memory. */
+char *patharena_alloc(struct patharena *arena, size_t size);
+
+/* Copy the first length bytes of s into the arena and terminate them. */
+char *patharena_copy(struct patharena *arena, const char *s, size_t length);
+
+/* Release every string, keeping one block for reuse. */
+void patharena_reset(struct patharena *arena);
+
+/* Move all of from's blocks into to, leaving from empty. */
+void patharena_adopt(struct patharena *to, struct patharena *from);
+
+/* Bytes held in blocks, for accounting against memory budgets. */
+size_t patharena_size(const struct patharena *arena);
+
+void patharena_free(struct patharena *arena);
+
+#endif
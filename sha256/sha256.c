@@ -1,6 +1,9 @@
 /* Public domain SHA-256 implementation, from https://github.com/983/SHA-256.
 */
 #include "sha256.h"
+#include "sha256_x86.h"
+
+#include <string.h>
 
 static inline uint32_t rotr(uint32_t x, int n){
     return (x >> n) | (x << (32 - n));
@@ -34,8 +37,7 @@ static inline void update_w(uint32_t *w, int i, const uint8_t *buffer){
     }
 }
 
-static void sha256_block(struct sha256 *sha){
-    uint32_t *state = sha->state;
+static void sha256_block(uint32_t *state, const uint8_t *block){
 
     static const uint32_t k[8 * 8] = {
         0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
@@ -69,7 +71,7 @@ static void sha256_block(struct sha256 *sha){
 
     int i, j;
     for (i = 0; i < 64; i += 16){
-        update_w(w, i, sha->buffer);
+        update_w(w, i, block);
 
         for (j = 0; j < 16; j += 4){
             uint32_t temp;
@@ -98,6 +100,27 @@ static void sha256_block(struct sha256 *sha){
     state[7] += h;
 }
 
+static void sha256_blocks_portable(uint32_t *state, const uint8_t *data, size_t n_blocks){
+    while (n_blocks--){
+        sha256_block(state, data);
+        data += 64;
+    }
+}
+
+/* Block function used for whole blocks; selected once at startup. */
+static sha256_blocks_fn *sha256_blocks = sha256_blocks_portable;
+
+#ifdef SHA256_HAVE_X86
+__attribute__((constructor))
+static void sha256_select_blocks(void){
+    sha256_blocks_fn *fn = sha256_x86_select();
+
+    if (fn){
+        sha256_blocks = fn;
+    }
+}
+#endif
+
 void sha256_init(struct sha256 *sha){
     sha->state[0] = 0x6a09e667;
     sha->state[1] = 0xbb67ae85;
@@ -117,17 +140,45 @@ void sha256_append_byte(struct sha256 *sha, uint8_t byte){
 
     if (sha->buffer_counter == 64){
         sha->buffer_counter = 0;
-        sha256_block(sha);
+        sha256_blocks(sha->state, sha->buffer, 1);
     }
 }
 
 void sha256_append(struct sha256 *sha, const void *src, size_t n_bytes){
     const uint8_t *bytes = (const uint8_t*)src;
-    size_t i;
 
-    for (i = 0; i < n_bytes; i++){
-        sha256_append_byte(sha, bytes[i]);
+    sha->n_bits += (uint64_t)n_bytes * 8;
+
+    /* Top up a partially filled buffer first. */
+    if (sha->buffer_counter != 0){
+        size_t n = 64 - sha->buffer_counter;
+        if (n > n_bytes){
+            n = n_bytes;
+        }
+
+        memcpy(sha->buffer + sha->buffer_counter, bytes, n);
+        sha->buffer_counter += n;
+        bytes += n;
+        n_bytes -= n;
+
+        if (sha->buffer_counter < 64){
+            return;
+        }
+
+        sha->buffer_counter = 0;
+        sha256_blocks(sha->state, sha->buffer, 1);
+    }
+
+    /* Hash whole blocks straight from the caller's memory. */
+    if (n_bytes >= 64){
+        sha256_blocks(sha->state, bytes, n_bytes / 64);
+        bytes += n_bytes & ~(size_t)63;
+        n_bytes &= 63;
     }
+
+    /* Keep the remainder for the next call. */
+    memcpy(sha->buffer, bytes, n_bytes);
+    sha->buffer_counter = n_bytes;
 }
 
 void sha256_finalize(struct sha256 *sha){
@@ -0,0 +1,99 @@
+/* x86 block compression backends for the SHA-256 implementation in sha256.c.
+
+   sha256_blocks_shani uses the SHA extensions (SHA-NI) and keeps the working
+   state in registers across consecutive blocks. The backend is chosen at
+   runtime from CPUID, so the binary still runs on any x86 processor; CPUs
+   without SHA-NI use the portable code in sha256.c.
+*/
+#include "sha256_x86.h"
+
+#ifdef SHA256_HAVE_X86
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static const uint32_t k[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t *state, const uint8_t *data, size_t n_blocks){
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, tmp, msg;
+    __m128i m[4];
+    int g;
+
+    /* Rearrange the state into the ABEF/CDGH layout used by sha256rnds2. */
+    tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+    state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);
+    state1 = _mm_shuffle_epi32(state1, 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (n_blocks--){
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+
+        for (g = 0; g < 16; g++){
+            if (g < 4){
+                m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + g * 16)), mask);
+            }else{
+                tmp = _mm_sha256msg1_epu32(m[g & 3], m[(g + 1) & 3]);
+                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(m[(g + 3) & 3], m[(g + 2) & 3], 4));
+                m[g & 3] = _mm_sha256msg2_epu32(tmp, m[(g + 3) & 3]);
+            }
+
+            msg = _mm_add_epi32(m[g & 3], _mm_load_si128((const __m128i*)&k[g * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+
+        data += 64;
+    }
+
+    /* Back to ABCD/EFGH. */
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+sha256_blocks_fn *sha256_x86_select(void){
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)){
+        return 0;
+    }
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)){
+        return sha256_blocks_shani;
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,24 @@
+/* x86 block compression backends for the SHA-256 implementation in sha256.c.
+*/
+#ifndef SHA256_X86_H
+#define SHA256_X86_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(SHA256_PORTABLE_ONLY)
+#define SHA256_HAVE_X86 1
+#endif
+
+/* Compress n_blocks consecutive 64-byte blocks into state. */
+typedef void sha256_blocks_fn(uint32_t *state, const uint8_t *data, size_t n_blocks);
+
+#ifdef SHA256_HAVE_X86
+/*
+ * Return the fastest block function supported by the running CPU, or 0 if
+ * the portable implementation should be used.
+ */
+sha256_blocks_fn *sha256_x86_select(void);
+#endif
+
+#endif
@@ -0,0 +1,390 @@
+/* Multi-buffer SHA-256: hashes several independent messages at once, one per
+   SIMD lane.
+
+   Each lane walks its message's whole blocks in place and then one or two
+   padded tail blocks kept in the lane. The lanes are stepped together one
+   block at a time; as soon as a message runs out of blocks its digest is
+   extracted and the lane can be given a new job while the others carry on.
+*/
+#include "sha256mb.h"
+#include "sha256_x86.h"
+
+#include <string.h>
+
+#ifdef SHA256_HAVE_X86
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+#define XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256(a, b), c)
+
+/*
+ * Load words 0-7 or 8-15 of every lane's block and transpose them so that
+ * w[i] holds word i of all eight lanes.
+ */
+__attribute__((target("avx2")))
+static inline void load_transposed(__m256i *w, const uint8_t **blocks, int offset){
+    const __m256i bswap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                            0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m256i r[8], t[8], u[8];
+    int i;
+
+    for (i = 0; i < 8; i++){
+        r[i] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(blocks[i] + offset)), bswap);
+    }
+
+    for (i = 0; i < 8; i += 2){
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+
+    for (i = 0; i < 8; i += 4){
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+
+    for (i = 0; i < 4; i++){
+        w[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        w[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+/* Compress one block in each of eight lanes, starting at lane 0 of blocks. */
+__attribute__((target("avx2")))
+static void sha256_x8_avx2(uint32_t (*state)[SHA256MB_LANES], int lane, const uint8_t **blocks){
+    __m256i w[16];
+    __m256i s[8];
+    __m256i a, b, c, d, e, f, g, h;
+    int i;
+
+    load_transposed(w, blocks + lane, 0);
+    load_transposed(w + 8, blocks + lane, 32);
+
+    for (i = 0; i < 8; i++){
+        s[i] = _mm256_loadu_si256((const __m256i*)&state[i][lane]);
+    }
+
+    a = s[0];
+    b = s[1];
+    c = s[2];
+    d = s[3];
+    e = s[4];
+    f = s[5];
+    g = s[6];
+    h = s[7];
+
+    for (i = 0; i < 64; i++){
+        __m256i wi, t1, t2;
+
+        if (i < 16){
+            wi = w[i];
+        }else{
+            __m256i w15 = w[(i + 1) & 15];
+            __m256i w2 = w[(i + 14) & 15];
+            __m256i s0 = XOR3(ROTR8(w15, 7), ROTR8(w15, 18), _mm256_srli_epi32(w15, 3));
+            __m256i s1 = XOR3(ROTR8(w2, 17), ROTR8(w2, 19), _mm256_srli_epi32(w2, 10));
+
+            wi = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], w[(i + 9) & 15]), _mm256_add_epi32(s0, s1));
+            w[i & 15] = wi;
+        }
+
+        t1 = _mm256_add_epi32(h, XOR3(ROTR8(e, 6), ROTR8(e, 11), ROTR8(e, 25)));
+        t1 = _mm256_add_epi32(t1, _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+        t1 = _mm256_add_epi32(t1, _mm256_add_epi32(wi, _mm256_set1_epi32(k[i])));
+
+        t2 = XOR3(ROTR8(a, 2), ROTR8(a, 13), ROTR8(a, 22));
+        t2 = _mm256_add_epi32(t2, _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b))));
+
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32(t1, t2);
+    }
+
+    s[0] = _mm256_add_epi32(s[0], a);
+    s[1] = _mm256_add_epi32(s[1], b);
+    s[2] = _mm256_add_epi32(s[2], c);
+    s[3] = _mm256_add_epi32(s[3], d);
+    s[4] = _mm256_add_epi32(s[4], e);
+    s[5] = _mm256_add_epi32(s[5], f);
+    s[6] = _mm256_add_epi32(s[6], g);
+    s[7] = _mm256_add_epi32(s[7], h);
+
+    for (i = 0; i < 8; i++){
+        _mm256_storeu_si256((__m256i*)&state[i][lane], s[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void sha256_x16_avx2(uint32_t (*state)[SHA256MB_LANES], const uint8_t **blocks){
+    sha256_x8_avx2(state, 0, blocks);
+    sha256_x8_avx2(state, 8, blocks);
+}
+
+#define ROTR16(x, n) _mm512_ror_epi32(x, n)
+
+#define XOR3_16(a, b, c) _mm512_ternarylogic_epi32(a, b, c, 0x96)
+
+/* Compress one block in each of the sixteen lanes. */
+__attribute__((target("avx2,avx512f")))
+static void sha256_x16_avx512(uint32_t (*state)[SHA256MB_LANES], const uint8_t **blocks){
+    __m256i lo[16], hi[16];
+    __m512i w[16];
+    __m512i s[8];
+    __m512i a, b, c, d, e, f, g, h;
+    int i;
+
+    load_transposed(lo, blocks, 0);
+    load_transposed(lo + 8, blocks, 32);
+    load_transposed(hi, blocks + 8, 0);
+    load_transposed(hi + 8, blocks + 8, 32);
+
+    for (i = 0; i < 16; i++){
+        w[i] = _mm512_inserti64x4(_mm512_castsi256_si512(lo[i]), hi[i], 1);
+    }
+
+    for (i = 0; i < 8; i++){
+        s[i] = _mm512_loadu_si512(state[i]);
+    }
+
+    a = s[0];
+    b = s[1];
+    c = s[2];
+    d = s[3];
+    e = s[4];
+    f = s[5];
+    g = s[6];
+    h = s[7];
+
+    for (i = 0; i < 64; i++){
+        __m512i wi, t1, t2;
+
+        if (i < 16){
+            wi = w[i];
+        }else{
+            __m512i w15 = w[(i + 1) & 15];
+            __m512i w2 = w[(i + 14) & 15];
+            __m512i s0 = XOR3_16(ROTR16(w15, 7), ROTR16(w15, 18), _mm512_srli_epi32(w15, 3));
+            __m512i s1 = XOR3_16(ROTR16(w2, 17), ROTR16(w2, 19), _mm512_srli_epi32(w2, 10));
+
+            wi = _mm512_add_epi32(_mm512_add_epi32(w[i & 15], w[(i + 9) & 15]), _mm512_add_epi32(s0, s1));
+            w[i & 15] = wi;
+        }
+
+        /* 0xca selects f where e is set and g elsewhere; 0xe8 is majority. */
+        t1 = _mm512_add_epi32(h, XOR3_16(ROTR16(e, 6), ROTR16(e, 11), ROTR16(e, 25)));
+        t1 = _mm512_add_epi32(t1, _mm512_ternarylogic_epi32(e, f, g, 0xca));
+        t1 = _mm512_add_epi32(t1, _mm512_add_epi32(wi, _mm512_set1_epi32(k[i])));
+
+        t2 = XOR3_16(ROTR16(a, 2), ROTR16(a, 13), ROTR16(a, 22));
+        t2 = _mm512_add_epi32(t2, _mm512_ternarylogic_epi32(a, b, c, 0xe8));
+
+        h = g;
+        g = f;
+        f = e;
+        e = _mm512_add_epi32(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm512_add_epi32(t1, t2);
+    }
+
+    s[0] = _mm512_add_epi32(s[0], a);
+    s[1] = _mm512_add_epi32(s[1], b);
+    s[2] = _mm512_add_epi32(s[2], c);
+    s[3] = _mm512_add_epi32(s[3], d);
+    s[4] = _mm512_add_epi32(s[4], e);
+    s[5] = _mm512_add_epi32(s[5], f);
+    s[6] = _mm512_add_epi32(s[6], g);
+    s[7] = _mm512_add_epi32(s[7], h);
+
+    for (i = 0; i < 8; i++){
+        _mm512_storeu_si512(state[i], s[i]);
+    }
+}
+
+#endif
+
+/* Compress one block in every lane; selected once at startup. */
+static void (*sha256mb_blocks)(uint32_t (*state)[SHA256MB_LANES], const uint8_t **blocks) = 0;
+
+#ifdef SHA256_HAVE_X86
+__attribute__((constructor))
+static void sha256mb_select_blocks(void){
+    unsigned int eax, ebx, ecx, edx;
+    int shani = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+
+    __builtin_cpu_init();
+
+    /*
+     * Sixteen AVX-512 lanes outrun SHA-NI by about 2.5x, but AVX2 lanes only
+     * break even with it, so they are used only on CPUs without SHA-NI.
+     */
+    if (__builtin_cpu_supports("avx512f")){
+        sha256mb_blocks = sha256_x16_avx512;
+    }else if (__builtin_cpu_supports("avx2") && !shani){
+        sha256mb_blocks = sha256_x16_avx2;
+    }
+}
+#endif
+
+int sha256mb_supported(void){
+    return sha256mb_blocks != 0;
+}
+
+static const uint32_t initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* Block fed to idle lanes; their results are never read. */
+static const uint8_t idle_block[64];
+
+void sha256mb_init(struct sha256mb *mb){
+    memset(mb, 0, sizeof(*mb));
+}
+
+static void lane_start(struct sha256mb *mb, int lane, struct sha256mb_job *job){
+    struct sha256mb_lane *l = &mb->lanes[lane];
+    size_t rest = job->n_bytes % 64;
+    uint64_t n_bits = (uint64_t)job->n_bytes * 8;
+    int i;
+
+    l->job = job;
+    l->next = (const uint8_t*)job->data;
+    l->n_blocks = job->n_bytes / 64;
+    l->n_tail_blocks = rest < 56 ? 1 : 2;
+
+    memset(l->tail, 0, sizeof(l->tail));
+    memcpy(l->tail, l->next + l->n_blocks * 64, rest);
+    if (l->n_blocks == 0){
+        l->next = l->tail;
+    }
+    l->tail[rest] = 0x80;
+
+    for (i = 0; i < 8; i++){
+        l->tail[l->n_tail_blocks * 64 - 1 - i] = (n_bits >> 8 * i) & 0xff;
+    }
+
+    for (i = 0; i < 8; i++){
+        mb->state[i][lane] = initial_state[i];
+    }
+
+    mb->n_active++;
+}
+
+static void lane_finish(struct sha256mb *mb, int lane){
+    struct sha256mb_lane *l = &mb->lanes[lane];
+    uint8_t *ptr = l->job->digest;
+    int i, j;
+
+    for (i = 0; i < 8; i++){
+        for (j = 3; j >= 0; j--){
+            *ptr++ = (mb->state[i][lane] >> j * 8) & 0xff;
+        }
+    }
+
+    mb->done[mb->n_done++] = l->job;
+    l->job = 0;
+    mb->n_active--;
+}
+
+/* Step all lanes until the shortest remaining message is complete. */
+static void run_lanes(struct sha256mb *mb){
+    const uint8_t *blocks[SHA256MB_LANES];
+    size_t steps = (size_t)-1;
+    size_t step;
+    int lane;
+
+    for (lane = 0; lane < SHA256MB_LANES; lane++){
+        struct sha256mb_lane *l = &mb->lanes[lane];
+
+        if (l->job && l->n_blocks + l->n_tail_blocks < steps){
+            steps = l->n_blocks + l->n_tail_blocks;
+        }
+    }
+
+    for (step = 0; step < steps; step++){
+        for (lane = 0; lane < SHA256MB_LANES; lane++){
+            struct sha256mb_lane *l = &mb->lanes[lane];
+
+            if (!l->job){
+                blocks[lane] = idle_block;
+                continue;
+            }
+
+            blocks[lane] = l->next;
+            l->next += 64;
+
+            if (l->n_blocks > 0){
+                if (--l->n_blocks == 0){
+                    l->next = l->tail;
+                }
+            }else{
+                l->n_tail_blocks--;
+            }
+        }
+
+        sha256mb_blocks(mb->state, blocks);
+    }
+
+    for (lane = 0; lane < SHA256MB_LANES; lane++){
+        struct sha256mb_lane *l = &mb->lanes[lane];
+
+        if (l->job && l->n_blocks == 0 && l->n_tail_blocks == 0){
+            lane_finish(mb, lane);
+        }
+    }
+}
+
+struct sha256mb_job *sha256mb_submit(struct sha256mb *mb, struct sha256mb_job *job){
+    int lane;
+
+    for (lane = 0; lane < SHA256MB_LANES; lane++){
+        if (!mb->lanes[lane].job){
+            lane_start(mb, lane, job);
+            break;
+        }
+    }
+
+    if (mb->n_active == SHA256MB_LANES){
+        run_lanes(mb);
+    }
+
+    return mb->n_done > 0 ? mb->done[--mb->n_done] : 0;
+}
+
+struct sha256mb_job *sha256mb_flush(struct sha256mb *mb){
+    if (mb->n_done == 0 && mb->n_active > 0){
+        run_lanes(mb);
+    }
+
+    return mb->n_done > 0 ? mb->done[--mb->n_done] : 0;
+}
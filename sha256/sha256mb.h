@@ -0,0 +1,62 @@
+/* Multi-buffer SHA-256: hashes several independent messages at once, one per
+   SIMD lane.
+*/
+#ifndef SHA256MB_H
+#define SHA256MB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+#define SHA256MB_LANES 16
+
+/*
+ * A message to hash. data and n_bytes are set by the caller and must stay
+ * valid until the job is handed back; digest is filled in on completion.
+ */
+typedef struct sha256mb_job {
+    const void *data;
+    size_t n_bytes;
+    uint8_t digest[SHA256_BYTES_SIZE];
+    void *user;
+} sha256mb_job;
+
+typedef struct sha256mb_lane {
+    struct sha256mb_job *job;
+    const uint8_t *next;
+    size_t n_blocks;
+    size_t n_tail_blocks;
+    uint8_t tail[128];
+} sha256mb_lane;
+
+typedef struct sha256mb {
+    uint32_t state[8][SHA256MB_LANES];
+    struct sha256mb_lane lanes[SHA256MB_LANES];
+    struct sha256mb_job *done[SHA256MB_LANES];
+    int n_active;
+    int n_done;
+} sha256mb;
+
+/*
+ * Nonzero if the running CPU has a multi-buffer kernel that beats hashing
+ * the same messages one at a time.
+ */
+int sha256mb_supported(void);
+
+void sha256mb_init(struct sha256mb *mb);
+
+/*
+ * Queue a job in a free lane. Once every lane is busy, the lanes are run
+ * until at least one message is complete, so a lane is always free for the
+ * next call. Returns a completed job, or 0 if none is ready yet.
+ */
+struct sha256mb_job *sha256mb_submit(struct sha256mb *mb, struct sha256mb_job *job);
+
+/*
+ * Return a completed job, running the lanes if necessary, or 0 once every
+ * submitted job has been handed back.
+ */
+struct sha256mb_job *sha256mb_flush(struct sha256mb *mb);
+
+#endif
@@ -0,0 +1,132 @@
+/* outbuffer tests Copyright (c) 2025 Adrian Lopez
+
+   This software is provided 'as-is', without any express or implied warranty.
+   In no event will the authors be held liable for any damages arising from the
+   use of this software.
+
+   Permission is granted to anyone to use this software for any purpose,
+   including commercial applications, and to alter it and redistribute it
+   freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+      claim that you wrote the original software. If you use this software in a
+      product, an acknowledgment in the product documentation would be
+      appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+      misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+*/
+
+/*
+ * Write pseudo-random numbers, digests and strings through outbuffer with
+ * several buffer sizes and check that the bytes written are exactly those
+ * printf would have produced.
+ */
+
+#define _GNU_SOURCE
+
+#include "../outbuffer.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORD_COUNT 100000
+#define DIGEST_SIZE 32
+#define LONG_WRITE_SIZE 5000
+
+static uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static int check(size_t buffersize) {
+    static const int64_t edges[] = { 0, 1, -1, 9, 10, 99, 100, -100, INT64_MAX, INT64_MIN, 999999999999999999LL };
+    static char longwrite[LONG_WRITE_SIZE];
+
+    FILE *actual = tmpfile();
+    char *expectedtext = 0;
+    size_t expectedsize = 0;
+    FILE *expected = open_memstream(&expectedtext, &expectedsize);
+    if (!actual || !expected)
+        return 0;
+
+    struct outbuffer *out = outbuffer_new(fileno(actual), buffersize);
+    if (!out)
+        return 0;
+
+    memset(longwrite, 'x', sizeof(longwrite));
+
+    size_t r;
+    for (r = 0; r < RECORD_COUNT; ++r) {
+        uint64_t u = next() >> (next() % 64);
+        if (r < sizeof(edges) / sizeof(edges[0]))
+            u = (uint64_t)edges[r];
+
+        unsigned char digest[DIGEST_SIZE];
+        int x;
+        for (x = 0; x < DIGEST_SIZE; ++x)
+            digest[x] = (unsigned char)next();
+
+        outbuffer_putu64(out, u);
+        outbuffer_putc(out, ' ');
+        outbuffer_puti64(out, (int64_t)u);
+        outbuffer_putc(out, ' ');
+        outbuffer_puthex(out, digest, DIGEST_SIZE);
+        outbuffer_puts(out, " path\n");
+
+        fprintf(expected, "%" PRIu64 " %" PRId64 " ", u, (int64_t)u);
+        for (x = 0; x < DIGEST_SIZE; ++x)
+            fprintf(expected, "%02x", digest[x]);
+        fprintf(expected, " path\n");
+
+        /* Now and then a write larger than the buffer. */
+        if (r % 1000 == 0) {
+            outbuffer_write(out, longwrite, sizeof(longwrite));
+            fwrite(longwrite, 1, sizeof(longwrite), expected);
+        }
+    }
+
+    int ok = outbuffer_flush(out) && outbuffer_error(out) == 0;
+    outbuffer_free(out);
+    fclose(expected);
+
+    off_t size = lseek(fileno(actual), 0, SEEK_END);
+    ok = ok && size >= 0 && (size_t)size == expectedsize;
+
+    char *actualtext = malloc(expectedsize + 1);
+    rewind(actual);
+    ok = ok && actualtext && fread(actualtext, 1, expectedsize, actual) == expectedsize;
+    ok = ok && memcmp(actualtext, expectedtext, expectedsize) == 0;
+
+    free(actualtext);
+    free(expectedtext);
+    fclose(actual);
+
+    return ok;
+}
+
+int main(void) {
+    static const size_t sizes[] = { 1, 100, 4096, 1048576 };
+    int failures = 0;
+
+    size_t s;
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        if (!check(sizes[s])) {
+            printf("FAIL: outbuffer output differs from printf with a %zu-byte buffer\n", sizes[s]);
+            ++failures;
+        }
+    }
+
+    if (failures == 0)
+        printf("outbuffer output matches printf\n");
+
+    return failures != 0;
+}
@@ -0,0 +1,250 @@
+#!/bin/sh
+#
+# Regression tests for dirchanges: tests/run.sh [DIRCHANGES]
+#
+# Outputs in tests/expected must be matched byte for byte. Those for what
+# dirchanges 1.0.0 could already do were produced by it, with its directory
+# listings put in path order, which -H uses now. The remaining checks run
+# the same inputs with options that change only how the work is done (jobs,
+# memory budget, formats, reuse, cache) and require the output to stay the
+# same.
+
+BIN=${1:-./dirchanges}
+case $BIN in
+	/*) ;;
+	*) BIN=$PWD/$BIN ;;
+esac
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+EXPECTED=$TESTS/expected
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/dirchanges-tests.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# Run through a link so that messages name the program the same way every time.
+mkdir "$WORK/bin" && ln -s "$BIN" "$WORK/bin/dirchanges" || exit 1
+PATH=$WORK/bin:$PATH
+
+failures=0
+checks=0
+
+fail()
+{
+	echo "FAIL: $1"
+	failures=$((failures + 1))
+}
+
+# run NAME ARGS...: keep standard output and the exit status in NAME.out and
+# standard error in NAME.err.
+run()
+{
+	name=$1
+	shift
+
+	dirchanges "$@" > "$WORK/$name.stdout" 2> "$WORK/$name.err"
+	status=$?
+
+	{ cat "$WORK/$name.stdout"; echo "exit $status"; } > "$WORK/$name.out"
+
+	if grep -q "Sanitizer\|runtime error" "$WORK/$name.err"; then
+		fail "$name: sanitizer report"
+		cat "$WORK/$name.err"
+	fi
+
+	checks=$((checks + 1))
+}
+
+# expect NAME ARGS...: output, status and messages must match tests/expected/NAME.
+expect()
+{
+	name=$1
+	run "$@"
+
+	if ! cat "$WORK/$name.out" "$WORK/$name.err" | cmp -s - "$EXPECTED/$name"; then
+		fail "$name"
+		cat "$WORK/$name.out" "$WORK/$name.err" | diff "$EXPECTED/$name" - | head -10
+	fi
+}
+
+# same NAME REFERENCE ARGS...: output and status must match those of an earlier run.
+same()
+{
+	name=$1
+	reference=$2
+	shift 2
+	run "$name" "$@"
+
+	if ! cmp -s "$WORK/$reference.out" "$WORK/$name.out"; then
+		fail "$name (differs from $reference)"
+		diff "$WORK/$reference.out" "$WORK/$name.out" | head -10
+	fi
+}
+
+# mkfile PATH CONTENT: create a file, and the directories above it.
+mkfile()
+{
+	mkdir -p "$(dirname "$1")"
+	printf '%s' "$2" > "$1"
+}
+
+# many DIR COUNT: fill DIR with COUNT files of different sizes.
+many()
+{
+	mkdir -p "$1"
+	awk -v dir="$1" -v count="$2" 'BEGIN {
+		for (i = 0; i < count; ++i) {
+			file = sprintf("%s/f%05d", dir, i);
+			for (j = 0; j < (i * 37) % 200; ++j)
+				printf("line %d of file %d\n", j, i) > file;
+			printf("") > file;
+			close(file);
+		}
+	}'
+}
+
+# archive NAME DIR: tar DIR with its entries in path order.
+archive()
+{
+	find "$2" | LC_ALL=C sort > "$1.list"
+	tar -cf "$1" --no-recursion -T "$1.list"
+}
+
+cd "$WORK" || exit 1
+
+mkfile a/one.txt "one
+"
+mkfile a/two.txt "two
+"
+mkfile a/dir1/f1 "f1
+"
+mkfile a/dir1/sub/f2 "f2
+"
+mkfile a/dir2/same "same
+"
+mkfile "a/with space" "space
+"
+mkfile a/zero ""
+mkdir a/empty
+many a/dir3 40
+
+cp -R a b
+mkfile b/two.txt "TWO
+"
+rm b/dir1/sub/f2
+mkfile b/dir1/new "new
+"
+rmdir b/empty
+mkfile b/newdir/x "x
+"
+echo changed >> b/dir3/f00007
+
+# Names the text formats cannot hold, which must survive spilling.
+mkfile "c/x
+y/ g" "g
+"
+mkfile "c/ lead/f" "f
+"
+mkfile "c/nl
+z" "c
+"
+cp -R c d
+mkfile "d/x
+y/ g" "G
+"
+rm "d/ lead/f"
+
+many big 3000
+
+archive a.tar a
+archive b.tar b
+gzip -n -c a.tar > a.tar.gz
+
+printf 'not a hashfile or archive\n' > bad1
+printf 'not one either\n' > bad2
+
+# Malformed hashfiles. Lines are numbered from the one after the header, and
+# the large one is split between threads with -j.
+digest=0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcd
+printf 'DIRHASH2\nD x\nR 0123 x/f\n' > short-digest.h2
+printf 'DIRHASH2\nD x\n\nR %sef x/f\nR %sg0 x/g\n' $digest $digest > bad-digest.h2
+printf 'DIRHASH2\nR %seg x/f\nR %s+f x/g\n' $digest $digest > odd-digest.h2
+printf 'DIRHASH2\nD x\nQ %sef x/q\n' $digest > bad-type.h2
+printf 'DIRHASH2\nD x\nR\n' > bare-type.h2
+sh "$TESTS/../bench/genhashfile.sh" 100000 | awk 'NR == 60001 || NR == 90001 { $1 = "X" } { print }' > late-error.h2
+
+dirchanges -H a > a.h2
+dirchanges -H b > b.h2
+
+# Against 1.0.0.
+expect hash-dir -H a
+expect hash-within -H a -w dir1
+expect hash-hashfile -H a.h2
+expect hash-tar -H a.tar
+expect hash-tgz -H a.tar.gz
+expect hash-stdin -H - < a.h2
+expect compare a b
+expect compare-short -s a b
+expect compare-hashfile a b.h2
+expect compare-hashfiles a.h2 b.h2
+expect compare-archive a.tar -w a b
+expect compare-within a -w dir1 b -w dir1
+expect compare-same a a.h2
+expect compare-stdin - b < a.h2
+expect compare-names c d
+expect error-order bad1 bad2
+expect error-to a bad2
+expect error-missing a missing
+expect error-short-digest -H short-digest.h2
+expect error-bad-digest -H bad-digest.h2
+expect odd-digest -H odd-digest.h2
+expect error-bad-type -H bad-type.h2
+expect error-bare-type -H bare-type.h2
+expect error-late -H late-error.h2
+expect error-late-j4 -j 4 -H late-error.h2
+expect error-late-to a late-error.h2
+
+# Threads.
+for jobs in 2 4; do
+	same hash-dir-j$jobs hash-dir -j $jobs -H a
+	same hash-tar-j$jobs hash-tar -j $jobs -H a.tar
+	same compare-j$jobs compare -j $jobs a b
+	same compare-archive-j$jobs compare-archive -j $jobs a.tar -w a b
+done
+
+# Memory budgets.
+for budget in 1 1K 64K; do
+	same compare-budget-$budget compare --max-memory=$budget a b
+	same compare-hashfiles-budget-$budget compare-hashfiles --max-memory=$budget a.h2 b.h2
+	same compare-names-budget-$budget compare-names --max-memory=$budget c d
+done
+
+# Output formats, read back.
+dirchanges -H --format=v3 a > a.h3
+dirchanges -H --format=v3 b > b.h3
+dirchanges -H --sorted a > a.sorted
+dirchanges -H --sorted b > b.sorted
+dirchanges -H --format=bin a > a.bin
+dirchanges -H --format=bin b > b.bin
+same compare-v3 compare a.h3 b.h3
+same compare-sorted compare a.sorted b.sorted
+same compare-bin compare a.bin b.bin
+same hash-v3 hash-dir -H a.h3
+same hash-bin hash-dir -H a.bin
+
+# Hashing from mappings, earlier digests and the cache.
+same hash-mmap hash-dir --mmap-min=1 -H a
+same hash-reuse hash-dir --reuse=a.h3 -H a
+same hash-cache hash-dir --cache=cache -H a
+same hash-cached hash-dir --cache=cache -H a
+
+# Directories large enough to be printed over several windows.
+dirchanges -H --format=bin big > big.bin
+run hash-big -H big.bin
+same hash-big-stream hash-big -H big
+same hash-big-stream-j4 hash-big -j 4 -H big
+
+# Option errors.
+expect jobs-junk -j 4x -H a
+expect format-unknown --format=v9 -H a
+
+echo "$checks checks, $failures failures"
+[ $failures -eq 0 ]